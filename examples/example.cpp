@@ -9,12 +9,12 @@
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
 #include <time.h>
+#include <LittleFS.h>
 #include <SimpleTelnet.h>
 
 #define TZ_DST "GMT0BST,M3.5.0/1,M10.5.0" // UK TZ string
 
 void toggleSecs(byte cID, char *cbuff); // Menu command to toggle time display
-char *cleanAsctime(char *timeStr);      // Clean up the asctime output
 
 const char *ssid = "yourssid";             // The SSID (name) of the Wi-Fi network you want to connect to
 const char *password = "yourpsk";          // The password of the Wi-Fi network
@@ -60,6 +60,9 @@ void setup()
 
     // telnetServer.setUserId(PSTR("andrew"));
     // telnetServer.setUserPw(PSTR("login"));
+    // LittleFS.begin(); // Keep a journal of log output in flash
+    // telnetServer.beginJournal(LittleFS);
+    // telnetServer.setLogStamps(true); // Time stamp log lines
     Serial.printf_P(PSTR("Telnet server started:\r\n"));
 }
 
@@ -80,7 +83,7 @@ void loop(void)
         {
             if (secDisp[i]) // If time display is enabled
             {
-                telnetClients[i].printf_P(PSTR("\r%s\r"), cleanAsctime(asctime(localtime(&now)))); // Print time string
+                telnetClients[i].printf_P(PSTR("\r%s\r"), telnetClock.wallClock()); // Print time string, formatted once for all clients
                 if (tm.tm_hour != lastHour)
                     telnetClients[i].printf_P(PSTR("\n")); // 1 hour has passed
             }
@@ -96,10 +99,3 @@ void toggleSecs(byte cID, char *cbuff)
     secDisp[cID] = !secDisp[cID];
     telnetClients[cID].printf_P(PSTR("Seconds display %s"), secDisp[cID] ? "enabled" : "disabled");
 }
-
-// Remove the trailing newline from the time string so it stays on a single line
-char *cleanAsctime(char *timeStr)
-{
-    timeStr[strlen(timeStr) - 1] = 0;
-    return timeStr;
-}
@@ -14,14 +14,16 @@
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
 #include <Time.h>
+#include <sys/time.h>
 #include <SimpleTelnet.h>
 
 //////////////////////////////////////////////////////
 // Global variables
 //////////////////////////////////////////////////////
-WiFiServer _telnetServer(SIMPLETELNETPORT); // Telnet server, describes the server
-WiFiClient telnetClients[MAXCLIENTS];       // Telnet client, describes the connected clients
-SimpleTelnet telnetServer;                  // the telnet server class
+WiFiClient telnetClients[MAXCLIENTS];                 // Telnet client, describes the connected clients
+SimpleTelnet telnetServer(MAXCLIENTS, telnetClients); // the telnet server class
+SimpleTelnet *SimpleTelnet::_current = &telnetServer; // Instance currently running a command
+TelnetClock telnetClock;                              // Formatted time strings shared by all instances
 
 //////////////////////////////////////////////////////
 // Internal menu support functions
@@ -34,7 +36,10 @@ void _listSessions(byte clientID, char *buff);
 void _setParm(byte clientID, char *buff);
 void _endSession(byte clientID, char *buff);
 void _killSession(byte clientID, char *buff);
-char *_printElapsedTime(char *buff, time_t elapsedTime);
+void _startUpload(byte clientID, char *buff);
+void _journalCmd(byte clientID, char *buff);
+void _defineMacro(byte clientID, char *buff);
+void _subscribe(byte clientID, char *buff);
 
 //////////////////////////////////////////////////////
 // Node class support
@@ -47,6 +52,8 @@ public:
     const char *commandHelp;                      // Pointer to menu help text
     const char *commandText;                      // Pointer to command text to match
     void (*commandAction)(byte cID, char *cbuff); // pointer to function to process the command
+    const char *commandMacro;                     // Pointer to the ; separated commands run by a macro, NULL if not a macro
+    bool dynamic;                                 // Text is in a heap block owned by the node, set for macros defined at run time
     byte matchlen;                                // Length of command required for a match
     Node *next;                                   // Pointer to next instance
 
@@ -55,6 +62,8 @@ public:
         commandHelp = helptext; // Store pointer to command help text
         commandText = text;     // Store pointer to command text
         commandAction = action; // Store pointer to function to action the command
+        commandMacro = NULL;    // Not a macro
+        dynamic = false;        // Text is not on the heap
         matchlen = mlen;        // Store command match length required
         next = NULL;            // Init pointer to next item in the list
     }
@@ -63,6 +72,8 @@ public:
         commandHelp = NULL;
         commandText = NULL;
         commandAction = NULL;
+        commandMacro = NULL;
+        dynamic = false;
         matchlen = 0;
         next = NULL;
     }
@@ -71,10 +82,41 @@ public:
 //////////////////////////////////////////////////////
 // Constructor
 //////////////////////////////////////////////////////
-SimpleTelnet::SimpleTelnet(void)
+SimpleTelnet::SimpleTelnet(void) : SimpleTelnet(MAXCLIENTS)
 {
+}
+
+SimpleTelnet::SimpleTelnet(byte maxClients, WiFiClient *clients, uint16_t bulkLen)
+{
+    if (maxClients > 32) // Slots are tracked in a 32 bit mask
+        maxClients = 32;
+    _maxClients = maxClients;
+    _clients = clients ? clients : new WiFiClient[maxClients];
+    _bulkLen = bulkLen ? bulkLen : BULKBUFFLEN; // The ring buffer index is taken modulo the length, it can't be 0
+    _server = NULL;                             // Created by begin() once the port is known
+    _sessions = NULL;                           // Allocated by begin(), keeps the RAM free until the instance is used
+    head = NULL;
+    _history = NULL;
+    _histHead = 0;
+    _histUsed = 0;
     _loginid = NULL;
     _loginpw = NULL;
+    _uploadSink = NULL;
+    _journalFS = NULL;
+    _journalBuff = NULL; // Allocated by beginJournal(), only instances with a journal pay for the buffer
+    _activeClients = 0;
+    _lastTick = 0;
+    _logStamps = false;
+    for (auto level = 0; level < LOGLEVELS; level++) // Nothing is wanted until a session connects
+        _subscribed[level] = 0;
+    for (auto topic = 0; topic < LOGTOPICS; topic++)
+        _topicNames[topic] = NULL;
+    _topicNames[LOGTOPIC_GENERAL] = PSTR("general");
+    for (uint32_t i = 0; i < LOGQUEUELEN; i++) // Mark all log records as free
+        _logQueue[i].seq.store(i, std::memory_order_relaxed);
+    _logEnqueuePos.store(0, std::memory_order_relaxed);
+    _logDequeuePos = 0;
+    _logDrops.store(0, std::memory_order_relaxed);
 }
 
 // overload default port
@@ -85,40 +127,79 @@ void SimpleTelnet::begin(void)
 
 void SimpleTelnet::begin(uint16_t port)
 {
-    _telnetServer.begin(port);            // start TCP server on port 23
-    _telnetServer.setNoDelay(true);       // Turns off nagle
-    for (auto i = 0; i < MAXCLIENTS; i++) // Initialise parsing vars
+    if (!_server)
+        _server = new WiFiServer(port);
+    if (!_sessions)
+    {
+        _sessions = new TelnetSession[_maxClients]();
+        for (auto i = 0; i < _maxClients; i++)
+            _sessions[i].bulkBuff = (char *)malloc(_bulkLen);
+        _history = (uint8_t *)malloc(HISTORYLEN);
+    }
+    _server->begin(port);                  // start TCP server on port
+    _server->setNoDelay(true);             // Turns off nagle
+    for (auto i = 0; i < _maxClients; i++) // Initialise parsing vars
         _resetParser(i);
     _addStdMenu();
     _bootTime = time(nullptr); // Seconds since 1/1/1970
 }
 
+//////////////////////////////////////////////////////
+// Access for menu callbacks
+//////////////////////////////////////////////////////
+WiFiClient &SimpleTelnet::client(byte clientID)
+{
+    return _clients[clientID];
+}
+
+byte SimpleTelnet::maxClients(void)
+{
+    return _maxClients;
+}
+
+// Menu callbacks are plain functions, this tells them which instance called them
+SimpleTelnet &SimpleTelnet::current(void)
+{
+    return *_current;
+}
+
 //////////////////////////////////////////////////////
 // loop() service routine, needs to be called from loop()
 //////////////////////////////////////////////////////
 void SimpleTelnet::action(void) // Service routine, called by loop()
 {
+    if (!_sessions)
+        return;      // begin() has not been called
+    _current = this; // Callbacks run from here belong to this instance
+    _drainLog();     // Pick up any log records posted from interrupts or other threads
+    if (_journalLen && millis() - _journalTimer > JOURNALFLUSHTIME)
+        flushJournal(); // Don't hold journal data in RAM for too long
+
     // Check for new connection
-    if (_telnetServer.hasClient()) // true if someone is trying to connect
+    if (_server->hasClient()) // true if someone is trying to connect
     {
         bool ConnectionRequest = true; // flag set to indicate we have a new connection that needs to be dealt with
 #ifdef TELNETDEBUG
         Serial.printf_P(PSTR("New connection detected\r\n"));
 #endif
-        for (auto i = 0; i < MAXCLIENTS; i++)
+        for (auto i = 0; i < _maxClients; i++)
         {
-            if (!telnetClients[i].connected()) // Find a free connection
+            if (!_clients[i].connected()) // Find a free connection
             {
-                telnetClients[i] = _telnetServer.available(); // Store the client object
-                telnetClients[i].setNoDelay(true);            // Turns off nagle
-                telnetClients[i].printf_P(PSTR("Welcome to %s %s, Press <ESC> to exit\r\n"), __PROJECT, __VERSION_SHORT);
+                _clients[i] = _server->available(); // Store the client object
+                _clients[i].setNoDelay(true);       // Turns off nagle
+                const uint8_t negotiate[] = {TELNET_IAC, TELNET_WILL, TELNET_ECHO, TELNET_IAC, TELNET_WILL, TELNET_SGA};
+                _clients[i].write(negotiate, sizeof(negotiate)); // We echo, the client sends each key as it is pressed
+                _clients[i].printf_P(PSTR("Welcome to %s %s, Press <ESC> to exit\r\n"), __PROJECT, __VERSION_SHORT);
                 printList(i);
-                _parseChar(0x00, i);            // Force new prompt to output
-                _connectionTimer[i] = millis(); // Set timeout timer
-                _resetParser(i);                // Clear the parser vars for this new client
+                _resetParser(i);                         // Clear the parser vars for this new client
+                _parseChar(0x00, i);                     // Force new prompt to output
+                _sessions[i].connectionTimer = millis(); // Set timeout timer
+                _activeClients |= 1UL << i;              // Service this slot from now on
+                _updateSubscriptions();
 #ifdef TELNETDEBUG
-                IPAddress ip = telnetClients[i].remoteIP();
-                Serial.printf_P(PSTR("Telnet client connected from %d.%d.%d.%d:%d on slot %d\r\n"), ip[0], ip[1], ip[2], ip[3], telnetClients[i].remotePort(), i);
+                IPAddress ip = _clients[i].remoteIP();
+                Serial.printf_P(PSTR("Telnet client connected from %d.%d.%d.%d:%d on slot %d\r\n"), ip[0], ip[1], ip[2], ip[3], _clients[i].remotePort(), i);
 #endif
                 ConnectionRequest = false; // Clear request flag
                 break;
@@ -126,13 +207,13 @@ void SimpleTelnet::action(void) // Service routine, called by loop()
         }
         if (ConnectionRequest) // Connection request is still outstanding but we don't have any resource to deal with it so kill the request
         {
-            WiFiClient abortConnection = _telnetServer.available(); // Store the client object
-            IPAddress ip = abortConnection.remoteIP();
+            WiFiClient abortConnection = _server->available(); // Store the client object
             uint16_t nextAvailableSlot = 65535;
-            for (auto i = 0; i < MAXCLIENTS; i++)
-                if (telnetServer.getTimeout(i) < nextAvailableSlot && telnetServer.getTimeout(i))
-                    nextAvailableSlot = telnetServer.getTimeout(i);
+            for (auto i = 0; i < _maxClients; i++)
+                if (getTimeout(i) < nextAvailableSlot && getTimeout(i))
+                    nextAvailableSlot = getTimeout(i);
 #ifdef TELNETDEBUG
+            IPAddress ip = abortConnection.remoteIP();
             Serial.printf_P(PSTR("Telnet connection request from %d.%d.%d.%d:%d rejected\r\n"), ip[0], ip[1], ip[2], ip[3], abortConnection.remotePort());
 #endif
             abortConnection.setNoDelay(true); // Turns off nagle
@@ -142,41 +223,63 @@ void SimpleTelnet::action(void) // Service routine, called by loop()
         }
     }
 
-    // Check for received data
-    for (auto i = 0; i < MAXCLIENTS; i++)
+    // Housekeeping (connection state and idle timeouts) is only checked once every IDLECHECKTIME
+    bool tick = millis() - _lastTick >= IDLECHECKTIME;
+    if (tick)
+        _lastTick = millis();
+
+    // Check for received data, only slots with a session are visited
+    for (uint32_t active = _activeClients; active; active &= active - 1)
     {
-        if (telnetClients[i].connected()) // if this client has a connection
+        byte i = __builtin_ctz(active); // Lowest active slot
+        TelnetSession &session = _sessions[i];
+        if (tick && !_clients[i].connected()) // Session has gone, stop servicing the slot
         {
-            if (telnetClients[i].available()) // Received a char
+            _activeClients &= ~(1UL << i);
+            _updateSubscriptions();
+            if (session.rawRemaining) // Session closed part way through an upload
+                _endUpload(i, UPLOAD_FAILED);
+            continue;
+        }
+        if (session.rawRemaining) // Session is receiving an upload, bypass the line parser
+            _receiveRaw(i);
+        else if (session.dumpActive) // Session is being sent the journal
+            _sendJournal(i);
+        else if (_clients[i].available()) // Received a char
+        {
+            session.connectionTimer = millis(); // Reset timeout timer
+            session.timeoutWarning = false;     // Clear flag to say we have issued the timeout warning
+            for (auto n = 0; n < RXBURST && _clients[i].available(); n++)
             {
-                _connectionTimer[i] = millis(); // Reset timeout timer
-                _timeoutWarning[i] = false;     // Clear flag to say we have issued the timeout warning
-                _parseChar(telnetClients[i].read(), i);
+                _parseChar(_clients[i].read(), i);
+                if (session.rawRemaining || session.dumpActive)
+                    break; // The command changed the session mode, leave the rest of the data for it
             }
-            else // Nothing received, chack for idle timeout
+        }
+        else if (tick && session.connectionTimeout) // Nothing received, chack for idle timeout if timeout is set
+        {
+            if ((millis() - session.connectionTimer) > (session.connectionTimeout - IDLEWARNING) && !session.timeoutWarning) // Check idle timeout
             {
-                if (_connectionTimeout[i]) // if timeout is set
-                {
-                    if ((millis() - _connectionTimer[i]) > (_connectionTimeout[i] - IDLEWARNING) && !_timeoutWarning[i]) // Check idle timeout
-                    {
-                        _timeoutWarning[i] = true; // Set flag to say we have issued the warning
+                session.timeoutWarning = true; // Set flag to say we have issued the warning
 #ifdef TELNETDEBUG
-                        Serial.printf_P(PSTR("Client %d Inactivity timeout in 300 seconds\r\n"), i);
+                Serial.printf_P(PSTR("Client %d Inactivity timeout in 300 seconds\r\n"), i);
 #endif
-                        telnetClients[i].printf_P(PSTR("Inactivity timeout in 300 seconds\r\n"));
-                    }
-                    if (millis() - _connectionTimer[i] > _connectionTimeout[i]) // Check idle timeout
-                    {
+                _clients[i].printf_P(PSTR("Inactivity timeout in 300 seconds\r\n"));
+            }
+            if (millis() - session.connectionTimer > session.connectionTimeout) // Check idle timeout
+            {
 #ifdef TELNETDEBUG
-                        Serial.printf_P(PSTR("Client %d Inactivity timeout\r\n"), i);
+                Serial.printf_P(PSTR("Client %d Inactivity timeout\r\n"), i);
 #endif
-                        telnetClients[i].printf_P(PSTR("Inactivity timeout, bye\r\n"));
-                        telnetClients[i].flush(); // Flush any tx data
-                        telnetClients[i].stop();  // Session timeout, clear the connection
-                    }
-                }
+                _clients[i].printf_P(PSTR("Inactivity timeout, bye\r\n"));
+                _clients[i].flush();           // Flush any tx data
+                _clients[i].stop();            // Session timeout, clear the connection
+                _activeClients &= ~(1UL << i); // Nothing more to service
+                _updateSubscriptions();
+                continue;
             }
         }
+        _drainBulk(i); // Interactive output has been dealt with, send any queued log output
     }
 }
 
@@ -185,101 +288,380 @@ void SimpleTelnet::action(void) // Service routine, called by loop()
 //////////////////////////////////////////////////////
 void SimpleTelnet::_resetParser(byte clientID)
 {
-    _rxbuff[clientID][0] = '\0';
-    _lastbuff[clientID][0] = '\0';
-    _timeoutWarning[clientID] = false;
-    _uparrowState[clientID] = 0;
-    _connectionTimeout[clientID] = IDLETIMEOUT;
-    _authenticated[clientID] = false;
-    _idOK[clientID] = false;
-    _pwOK[clientID] = false;
+    TelnetSession &session = _sessions[clientID];
+    session.rxbuff[0] = '\0';
+    session.rxptr = 0;
+    session.rxcursor = 0;
+    session.escState = EDIT_NONE;
+    session.histBack = 0;
+    session.timeoutWarning = false;
+    session.connectionTimeout = IDLETIMEOUT;
+    session.authenticated = false;
+    session.idOK = false;
+    session.pwOK = false;
+    session.bulkHead = 0;
+    session.bulkTail = 0;
+    session.bulkSuppressed = 0;
+    session.bulkPartial = false;
+    session.dumpActive = false;
+    if (session.dumpFile) // Previous session on this slot closed during journal output
+        session.dumpFile.close();
+    session.subTopics = 0xFFFFFFFF; // New sessions get everything from LOGLEVEL_INFO up
+    session.subLevel = LOGLEVEL_INFO;
+    _historyForget(clientID);
+    if (session.rawRemaining) // Previous session on this slot died during an upload
+        _endUpload(clientID, UPLOAD_FAILED);
 }
 
 //////////////////////////////////////////////////////
 // Process a received data character
 //////////////////////////////////////////////////////
+//
+// The server echoes the input (the client is asked to stop local echo when it connects), so the line can be edited
+// in place.  Each key sends only the bytes needed to update the screen, and everything a key sends goes in one write.
+// Cursor keys are turned into the equivalent ctrl key, so ^A/^E (home/end), ^B/^F (left/right), ^P/^N (up/down) and
+// ^D (delete) also work.
+//
+//////////////////////////////////////////////////////
 void SimpleTelnet::_parseChar(char rxval, byte clientID)
 {
-    static byte rxptr[MAXCLIENTS] = {0}; // Pointer to next free space in tx buffer
-    bool eol[MAXCLIENTS] = {false};      // end of line received indicator causing input to be processed
+    TelnetSession &session = _sessions[clientID];
+    byte c = rxval;
+    bool eol = false;         // end of line received indicator causing input to be processed
+    char out[RXBUFFLEN + 16]; // Screen update for this key
+    char *op = out;
 #ifdef TELNETDEBUG
     Serial.printf("[%d]%c", clientID, rxval);
 #endif
-    // Check for up-arrow (Esc 5b 41)
-    if (rxval == 0x1B) // Esc
-    {
-        _uparrowState[clientID] = 1;
-        rxval = 0xFF; // reset val to be ignored
-    }
-    else if (rxval == 0x5B && _uparrowState[clientID] == 1) // Esc 5B
-    {
-        _uparrowState[clientID] = 2;
-        rxval = 0xFF; // reset val to be ignored
-    }
-    else if (rxval == 0x41 && _uparrowState[clientID] == 2) // Esc 5B 41, got an up arrow
+    switch (session.escState) // Part way through a telnet command or escape sequence
     {
-        strcpy(_rxbuff[clientID], _lastbuff[clientID]);                     // restore previous command
-        rxptr[clientID] = strlen(_rxbuff[clientID]);                        // restore pointer
-        telnetClients[clientID].printf_P(PSTR("\r>%s"), _rxbuff[clientID]); // rewrite command to screen
-        rxval = 0xFF;                                                       // reset val to be ignored
+    case EDIT_IAC:
+        session.escState = c == TELNET_SB ? EDIT_SB : (c >= TELNET_WILL && c != TELNET_IAC ? EDIT_OPTION : EDIT_NONE);
+        return;
+    case EDIT_OPTION: // Replies to our option requests need no action
+        session.escState = EDIT_NONE;
+        return;
+    case EDIT_SB:
+        if (c == TELNET_IAC)
+            session.escState = EDIT_SBIAC;
+        return;
+    case EDIT_SBIAC:
+        session.escState = c == TELNET_SE ? EDIT_NONE : EDIT_SB;
+        return;
+    case EDIT_ESC:
+        session.escParam = 0;
+        session.escState = c == '[' ? EDIT_CSI : (c == 'O' ? EDIT_SS3 : EDIT_NONE);
+        if (session.escState != EDIT_NONE)
+            return;
+        break; // Not an escape sequence, treat as a normal character
+    case EDIT_CSI:
+        if (isdigit(c) || c == ';')
+        {
+            if (isdigit(c) && session.escParam < 100)
+                session.escParam = session.escParam * 10 + c - '0';
+            return;
+        }
+        session.escState = EDIT_NONE;
+        if (c == '~') // vt style Esc [ n ~ keys
+        {
+            switch (session.escParam)
+            {
+            case 1: // home
+            case 7:
+                c = 0x01;
+                break;
+            case 3: // delete
+                c = 0x04;
+                break;
+            case 4: // end
+            case 8:
+                c = 0x05;
+                break;
+            default:
+                return; // Ignore any other keys
+            }
+            break;
+        }
+        [[fallthrough]]; // The other keys are the same as Esc O
+    case EDIT_SS3:
+        session.escState = EDIT_NONE;
+        switch (c)
+        {
+        case 'A': // up, ^P
+            c = 0x10;
+            break;
+        case 'B': // down, ^N
+            c = 0x0E;
+            break;
+        case 'C': // right, ^F
+            c = 0x06;
+            break;
+        case 'D': // left, ^B
+            c = 0x02;
+            break;
+        case 'H': // home, ^A
+            c = 0x01;
+            break;
+        case 'F': // end, ^E
+            c = 0x05;
+            break;
+        default:
+            return; // Ignore any other keys
+        }
+        break;
+    case EDIT_CR:
+        session.escState = EDIT_NONE;
+        if (c == 0x0A || c == 0x00)
+            return; // CR LF or CR NUL is one end of line
+        break;
     }
-    else
-        _uparrowState[clientID] = 0; //  reset state, not up arrow string
 
-    switch (rxval)
+    bool hidden = _loginpw && session.idOK && !session.pwOK; // Don't echo the password
+    switch (c)
     {
-    case 0x00:                       // Special case to Flush buffer and Display command prompt
-        eol[clientID] = true;        // reset eol flag
-        rxptr[clientID] = 0;         // Reset ptr to start new line
-        _rxbuff[clientID][0] = '\0'; // reset buffer
+    case 0x00:                    // Special case to Flush buffer and Display command prompt
+        eol = true;               // reset eol flag
+        session.rxptr = 0;        // Reset ptr to start new line
+        session.rxbuff[0] = '\0'; // reset buffer
+        break;
+    case 0x01: // home
+        op = _editCursor(session, 0, op);
+        break;
+    case 0x02: // left
+        if (session.rxcursor)
+            op = _editCursor(session, session.rxcursor - 1, op);
+        break;
+    case 0x04: // delete the char under the cursor
+        if (session.rxcursor < session.rxptr)
+        {
+            memmove(&session.rxbuff[session.rxcursor], &session.rxbuff[session.rxcursor + 1], session.rxptr - session.rxcursor);
+            session.rxptr--;
+            op += sprintf_P(op, PSTR("\x1B[P"));
+        }
+        break;
+    case 0x05: // end
+        op = _editCursor(session, session.rxptr, op);
+        break;
+    case 0x06: // right
+        if (session.rxcursor < session.rxptr)
+            op = _editCursor(session, session.rxcursor + 1, op);
         break;
     case 0x08: // backspace
-        if (rxptr[clientID])
+    case 0x7F: // del, sent by most terminals for backspace
+        if (session.rxcursor)
         {
-            rxptr[clientID]--;
-            telnetClients[clientID].printf_P(PSTR(" \x08")); // clear last char 1B 5B 44 is left arrow, 08 is backspace
+            if (session.rxcursor == session.rxptr)
+                op += sprintf_P(op, PSTR("\x08 \x08")); // Last char, rub it out
+            else
+                op += sprintf_P(op, PSTR("\x08\x1B[P")); // Move left and delete a char, the terminal closes up the line
+            memmove(&session.rxbuff[session.rxcursor - 1], &session.rxbuff[session.rxcursor], session.rxptr - session.rxcursor + 1);
+            session.rxcursor--;
+            session.rxptr--;
         }
-        else
-            telnetClients[clientID].printf_P(PSTR(">")); // Replace the prompt if nothing in the buffer
         break;
     case 0x0D: // cr
-        if (strlen(_rxbuff[clientID]))
-            eol[clientID] = true; // new command entered so process it
+        session.escState = EDIT_CR;
+        hidden = false; // Always echo the end of the line
+        op += sprintf_P(op, PSTR("\r\n"));
+        if (session.rxptr)
+            eol = true; // new command entered so process it
         else
-            telnetClients[clientID].print(F(">")); // crlf ready for the next output
+            *op++ = '>'; // Nothing entered, new prompt
+        break;
+    case 0x0E: // down, towards the newest history entry
+        if (session.histBack)
+        {
+            char line[RXBUFFLEN];
+            if (--session.histBack == 0 || !_historyGet(clientID, session.histBack, line))
+                line[0] = '\0';
+            op = _editReplace(session, line, op);
+        }
+        break;
+    case 0x10: // up, back through the history
+    {
+        char line[RXBUFFLEN];
+        if (session.histBack < 255 && _historyGet(clientID, session.histBack + 1, line))
+        {
+            session.histBack++;
+            op = _editReplace(session, line, op);
+        }
         break;
+    }
     case 0x1B: // Escape
-    case '\t': // tab
-    case 0x0A: // nl
-    case 0xFF: // invalid char or char removed
-        break; // Discard these chars
+        session.escState = EDIT_ESC;
+        break;
+    case TELNET_IAC:
+        session.escState = EDIT_IAC;
+        break;
     default:
-        if (rxptr[clientID] < RXBUFFLEN - 1)              // if there is space in the command buffer
-            _rxbuff[clientID][rxptr[clientID]++] = rxval; // store the received char and point to the next free space
-        if (rxptr[clientID] == RXBUFFLEN - 1)
-            eol[clientID] = true; // We filled the rx buffer so process it
+        if (c < 0x20)
+            break;                         // Discard any other control chars
+        if (session.rxptr < RXBUFFLEN - 1) // if there is space in the command buffer
+        {
+            if (session.rxcursor < session.rxptr) // Insert, open a gap in the buffer and on the screen
+            {
+                memmove(&session.rxbuff[session.rxcursor + 1], &session.rxbuff[session.rxcursor], session.rxptr - session.rxcursor);
+                op += sprintf_P(op, PSTR("\x1B[@"));
+            }
+            session.rxbuff[session.rxcursor++] = c; // store the received char
+            session.rxptr++;
+            *op++ = c;
+        }
+        if (session.rxptr == RXBUFFLEN - 1)
+            eol = true; // We filled the rx buffer so process it
         break;
     }
-    _rxbuff[clientID][rxptr[clientID]] = '\0'; // Add new null terminator to rx buffer
+    session.rxbuff[session.rxptr] = '\0'; // Add new null terminator to rx buffer
+    if (op != out && !hidden)
+        _clients[clientID].write((const uint8_t *)out, op - out);
 
-    if (eol[clientID])
+    if (eol)
     {
-        if (_checkid(clientID, _rxbuff[clientID]))
+        if (_checkid(clientID, session.rxbuff))
         {
-            strcpy(_lastbuff[clientID], _rxbuff[clientID]);         // save previous command
-            telnetClients[clientID].print(F("\r"));                 // crlf ready for the next output
-            if (rxptr[clientID] && _rxbuff[clientID][0])            // if we have a command to check
-            {                                                       //
-                if (!_ProcessList(_rxbuff[clientID], clientID))     // Run the command entered past the handler functions
-                    telnetClients[clientID].print(F(">What?\r\n")); // print new prompt
-                else
-                    telnetClients[clientID].print(F("\r\n")); // crlf ready for the next output
-            }
-            telnetClients[clientID].print(F("\r>")); // crlf ready for the next output
+            if (session.rxbuff[0])
+                _historyAdd(clientID, session.rxbuff);
+            _clients[clientID].print(F("\r"));                // crlf ready for the next output
+            if (session.rxptr && session.rxbuff[0])           // if we have a command to check
+                _runCommands(session.rxbuff, clientID, 0, 0); // Run the command(s) entered past the handler functions
+            if (!session.rawRemaining && !session.dumpActive) // No prompt if the command started an upload or journal output
+                _clients[clientID].print(F("\r>"));           // crlf ready for the next output
         }
-        eol[clientID] = false;       // reset eol flag
-        rxptr[clientID] = 0;         // Reset ptr to start new line
-        _rxbuff[clientID][0] = '\0'; // reset buffer
+        eol = false;       // reset eol flag
+        session.rxptr = 0; // Reset ptr to start new line
+        session.rxcursor = 0;
+        session.histBack = 0;
+        session.rxbuff[0] = '\0'; // reset buffer
+    }
+}
+
+// Move the cursor to position to in the line, using backspaces or rewriting chars when that is shorter than an escape sequence
+char *SimpleTelnet::_editCursor(TelnetSession &session, byte to, char *out)
+{
+    if (to < session.rxcursor)
+    {
+        byte n = session.rxcursor - to;
+        if (n <= 4)
+            while (n--)
+                *out++ = '\x08';
+        else
+            out += sprintf_P(out, PSTR("\x1B[%dD"), n);
+    }
+    else if (to > session.rxcursor)
+    {
+        byte n = to - session.rxcursor;
+        if (n <= 4) // Rewrite the chars the cursor passes over
+        {
+            memcpy(out, &session.rxbuff[session.rxcursor], n);
+            out += n;
+        }
+        else
+            out += sprintf_P(out, PSTR("\x1B[%dC"), n);
+    }
+    session.rxcursor = to;
+    return out;
+}
+
+// Redraw the prompt and the line being edited after other output has overwritten them, leaving the cursor where it was
+char *SimpleTelnet::_editRedraw(TelnetSession &session, char *out)
+{
+    if (_loginid && !session.idOK)
+        out += sprintf_P(out, PSTR("login: "));
+    else if (_loginpw && !session.pwOK)
+        return out + sprintf_P(out, PSTR("Password: ")); // The password isn't echoed
+    else
+        *out++ = '>';
+    memcpy(out, session.rxbuff, session.rxptr);
+    out += session.rxptr;
+    byte cursor = session.rxcursor;
+    session.rxcursor = session.rxptr; // The cursor is now at the end of the line
+    return _editCursor(session, cursor, out);
+}
+
+// Replace the line being edited with text, keeping the start the two have in common and clearing any leftover chars
+char *SimpleTelnet::_editReplace(TelnetSession &session, const char *text, char *out)
+{
+    byte same = 0;
+    while (same < session.rxptr && text[same] == session.rxbuff[same])
+        same++;
+    out = _editCursor(session, same, out);
+    byte len = strlen(text);
+    memcpy(out, text + same, len - same);
+    out += len - same;
+    if (session.rxptr > len)
+        out += sprintf_P(out, PSTR("\x1B[K")); // Erase to end of line
+    memcpy(session.rxbuff, text, len + 1);
+    session.rxptr = len;
+    session.rxcursor = len;
+    return out;
+}
+
+//////////////////////////////////////////////////////
+// Command history support functions
+//////////////////////////////////////////////////////
+//
+// All the sessions of an instance share one ring buffer of HISTORYLEN bytes rather than each having a fixed buffer,
+// so a busy session can keep more history when the others are quiet.  Each entry is the command text followed by
+// the clientID and the text length, so the ring can be walked back from the newest entry.  New entries overwrite
+// the oldest, whichever session they belong to.
+//
+//////////////////////////////////////////////////////
+
+// Add a command line to the history, unless it repeats the client's last entry
+void SimpleTelnet::_historyAdd(byte clientID, const char *line)
+{
+    char last[RXBUFFLEN];
+    byte len = strlen(line);
+    if (!_history || len + 2 > HISTORYLEN)
+        return;
+    if (_historyGet(clientID, 1, last) && !strcmp(last, line))
+        return;
+    for (auto i = 0; i < len; i++)
+        _history[(_histHead + i) % HISTORYLEN] = line[i];
+    _history[(_histHead + len) % HISTORYLEN] = clientID;
+    _history[(_histHead + len + 1) % HISTORYLEN] = len;
+    _histHead = (_histHead + len + 2) % HISTORYLEN;
+    _histUsed = _histUsed + len + 2 < HISTORYLEN ? _histUsed + len + 2 : HISTORYLEN;
+}
+
+// Copy the back'th latest history entry of the client to buff, which must hold RXBUFFLEN chars.  Returns false if there isn't one
+bool SimpleTelnet::_historyGet(byte clientID, byte back, char *buff)
+{
+    uint16_t pos = _histHead;
+    uint16_t walked = 0;
+    while (_history && back && walked + 2 <= _histUsed)
+    {
+        byte len = _history[(pos + HISTORYLEN - 1) % HISTORYLEN];
+        byte id = _history[(pos + HISTORYLEN - 2) % HISTORYLEN];
+        if (walked + len + 2 > _histUsed || len >= RXBUFFLEN)
+            break;                                       // The oldest entry has been partly overwritten
+        pos = (pos + HISTORYLEN - len - 2) % HISTORYLEN; // Start of the entry
+        walked += len + 2;
+        if (id == clientID && !--back)
+        {
+            for (auto i = 0; i < len; i++)
+                buff[i] = _history[(pos + i) % HISTORYLEN];
+            buff[len] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drop the client's history entries so a new session on the slot can't see them
+void SimpleTelnet::_historyForget(byte clientID)
+{
+    uint16_t pos = _histHead;
+    uint16_t walked = 0;
+    while (_history && walked + 2 <= _histUsed)
+    {
+        byte len = _history[(pos + HISTORYLEN - 1) % HISTORYLEN];
+        if (walked + len + 2 > _histUsed)
+            break;
+        if (_history[(pos + HISTORYLEN - 2) % HISTORYLEN] == clientID)
+            _history[(pos + HISTORYLEN - 2) % HISTORYLEN] = 0xFF; // No longer belongs to any slot
+        pos = (pos + HISTORYLEN - len - 2) % HISTORYLEN;
+        walked += len + 2;
     }
 }
 
@@ -288,49 +670,50 @@ void SimpleTelnet::_parseChar(char rxval, byte clientID)
 //////////////////////////////////////////////////////
 bool SimpleTelnet::_checkid(byte clientID, char *rxbuff)
 {
+    TelnetSession &session = _sessions[clientID];
     // check id
-    if (!_idOK[clientID]) // id not checked
+    if (!session.idOK) // id not checked
     {
         if (!_loginid) // user id string is null (blank)
-            _idOK[clientID] = true;
+            session.idOK = true;
         else // Check login id against rxbuff
         {
             if (!strncmp_P(rxbuff, _loginid, strlen_P(_loginid)))
             {
-                _idOK[clientID] = true; // buff matched login id
+                session.idOK = true; // buff matched login id
                 rxbuff[0] = 0x00;
             }
             else
             {
-                telnetClients[clientID].printf_P(PSTR("login: "));
-                _idOK[clientID] = false;
+                _clients[clientID].printf_P(PSTR("login: "));
+                session.idOK = false;
                 return false;
             }
         }
     }
 
     // check pw
-    if (!_pwOK[clientID])
+    if (!session.pwOK)
     {
         if (!_loginpw) // pw is not set
-            _pwOK[clientID] = true;
+            session.pwOK = true;
         else // Check login id
         {
             if (!strncmp_P(rxbuff, _loginpw, strlen_P(_loginpw)))
             {
-                _pwOK[clientID] = true; // buff matched pw
+                session.pwOK = true; // buff matched pw
                 rxbuff[0] = 0x00;
             }
             else
             {
-                telnetClients[clientID].printf_P(PSTR("Password: "));
-                _pwOK[clientID] = false;
+                _clients[clientID].printf_P(PSTR("Password: "));
+                session.pwOK = false;
                 return false;
             }
         }
     }
 
-    return (_idOK[clientID] && _pwOK[clientID]);
+    return (session.idOK && session.pwOK);
 }
 
 //////////////////////////////////////////////////////
@@ -348,11 +731,682 @@ void SimpleTelnet::setUserPw(const char *pw)
     _loginpw = pw;
 }
 
+//////////////////////////////////////////////////////
+// Bulk output lane support functions
+//////////////////////////////////////////////////////
+//
+// Unsolicited log output is queued per client and only sent when the interactive lane (command replies and prompts)
+// is idle, so a busy log stream can never delay the reply to a command the user has just typed.
+//
+//////////////////////////////////////////////////////
+
+// Format a log line and queue it to all connected clients.  format is PROGMEM aware
+void SimpleTelnet::broadcast(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    _vbroadcast(LOGLEVEL_INFO, LOGTOPIC_GENERAL, format, args);
+    va_end(args);
+}
+
+// Format a log line and queue it to the clients subscribed to topic at level
+void SimpleTelnet::broadcast(byte level, byte topic, const char *format, ...)
+{
+    if (level >= LOGLEVELS || topic >= LOGTOPICS)
+        return;
+    va_list args;
+    va_start(args, format);
+    _vbroadcast(level, topic, format, args);
+    va_end(args);
+}
+
+void SimpleTelnet::_vbroadcast(byte level, byte topic, const char *format, va_list args)
+{
+    if (!(_subscribed[level] & (1UL << topic)))
+        return; // Nobody wants it, don't pay for the formatting
+    char line[LOGLINELEN];
+    uint16_t stampLen = 0;
+    if (_logStamps)
+    {
+        const char *stamp = telnetClock.stamp();
+        stampLen = strlen(stamp);
+        memcpy(line, stamp, stampLen);
+    }
+    int len = vsnprintf_P(line + stampLen, sizeof(line) - stampLen, format, args);
+    if (len <= 0)
+        return;
+    len += stampLen;
+    if (len >= LOGLINELEN) // Line was truncated
+        len = LOGLINELEN - 1;
+    _broadcastLine(line, len, level, topic);
+}
+
+// Turn log line time stamps on or off
+void SimpleTelnet::setLogStamps(bool enable)
+{
+    _logStamps = enable;
+}
+
+// Queue an already formatted line to the connected clients subscribed to topic at level
+void SimpleTelnet::_broadcastLine(const char *line, uint16_t len, byte level, byte topic)
+{
+    for (uint32_t active = _activeClients; active; active &= active - 1) // Only slots holding a session
+    {
+        byte i = __builtin_ctz(active);
+        if (level >= _sessions[i].subLevel && (_sessions[i].subTopics & (1UL << topic)))
+            _queueBulk(i, line, len);
+    }
+    if (level >= JOURNALLEVEL)
+        _journalLine(line, len);
+}
+
+//////////////////////////////////////////////////////
+// Log subscription support functions
+//////////////////////////////////////////////////////
+//
+// Each session subscribes to a set of topics at or above a level.  _subscribed[] holds, for each level, the topics
+// wanted by at least one session or the journal, so a log call nobody wants is rejected with a single mask test
+// before any formatting or copying is done.
+//
+//////////////////////////////////////////////////////
+
+// Name a log topic so it can be used with the subscribe command.  name is PROGMEM aware
+void SimpleTelnet::addTopic(byte topic, const char *name)
+{
+    if (topic < LOGTOPICS)
+        _topicNames[topic] = name;
+}
+
+// Rebuild the per level topic masks, called whenever a session or the journal starts, stops or changes subscription
+void SimpleTelnet::_updateSubscriptions(void)
+{
+    uint32_t subscribed[LOGLEVELS];
+    for (auto level = 0; level < LOGLEVELS; level++)
+        subscribed[level] = (_journalFS && level >= JOURNALLEVEL) ? 0xFFFFFFFF : 0;
+    for (uint32_t active = _activeClients; active; active &= active - 1)
+    {
+        TelnetSession &session = _sessions[__builtin_ctz(active)];
+        for (auto level = session.subLevel; level < LOGLEVELS; level++)
+            subscribed[level] |= session.subTopics;
+    }
+    for (auto level = 0; level < LOGLEVELS; level++) // Each mask is replaced in one write as postLog() may be reading it
+        _subscribed[level] = subscribed[level];
+}
+
+// Returns the topic id matching name, which may be a topic name or number, or LOGTOPICS if there isn't one
+byte SimpleTelnet::_findTopic(const char *name)
+{
+    if (isdigit(name[0]))
+    {
+        int topic = atoi(name);
+        return topic < LOGTOPICS ? topic : LOGTOPICS;
+    }
+    for (auto topic = 0; topic < LOGTOPICS; topic++)
+        if (_topicNames[topic] && !strcmp_P(name, _topicNames[topic]))
+            return topic;
+    return LOGTOPICS;
+}
+
+// Add a line to the clients bulk ring buffer, the whole line is dropped and counted if there is no room for it
+void SimpleTelnet::_queueBulk(byte clientID, const char *text, uint16_t len)
+{
+    TelnetSession &session = _sessions[clientID];
+    if (!session.bulkBuff) // Buffer couldn't be allocated, count the line as dropped
+    {
+        session.bulkSuppressed++;
+        return;
+    }
+    uint16_t used = (session.bulkHead + _bulkLen - session.bulkTail) % _bulkLen;
+    if (len > _bulkLen - 1 - used) // No room, summarise rather than block
+    {
+        session.bulkSuppressed++;
+        return;
+    }
+    uint16_t first = _bulkLen - session.bulkHead; // Space before the ring wraps
+    if (first > len)
+        first = len;
+    memcpy(&session.bulkBuff[session.bulkHead], text, first);
+    memcpy(&session.bulkBuff[0], text + first, len - first);
+    session.bulkHead = (session.bulkHead + len) % _bulkLen;
+}
+
+// Send some queued bulk output, but only while the interactive lane is idle and the tcp buffer has room to spare
+void SimpleTelnet::_drainBulk(byte clientID)
+{
+    TelnetSession &session = _sessions[clientID];
+    if (session.bulkHead == session.bulkTail && !session.bulkSuppressed)
+        return; // Nothing queued
+    if (!session.bulkPartial && session.rxbuff[0] && (millis() - session.connectionTimer) < BULKHOLDTIME)
+        return; // User is typing a command, hold the log output back for a while
+    if (session.rawRemaining || session.dumpActive)
+        return; // Don't disturb an upload or journal output in progress
+    int room = _clients[clientID].availableForWrite() - BULKRESERVE;
+    if (room <= 0)
+        return; // Keep the remaining tx space for command replies
+    if (room > BULKCHUNK)
+        room = BULKCHUNK;
+
+    if (!session.bulkPartial) // Clear the prompt and any part typed line, they are redrawn below the output
+        _clients[clientID].print(F("\r\x1B[K"));
+    if (session.bulkSuppressed && !session.bulkPartial)
+    {
+        _clients[clientID].printf_P(PSTR("\r[%u lines suppressed]\r\n"), session.bulkSuppressed);
+        session.bulkSuppressed = 0;
+    }
+    while (room > 0 && session.bulkHead != session.bulkTail)
+    {
+        uint16_t len = (session.bulkHead > session.bulkTail ? session.bulkHead : _bulkLen) - session.bulkTail; // Contiguous bytes to send
+        if (len > room)
+            len = room;
+        _clients[clientID].write((const uint8_t *)&session.bulkBuff[session.bulkTail], len);
+        session.bulkTail = (session.bulkTail + len) % _bulkLen;
+        session.bulkPartial = session.bulkBuff[(session.bulkTail + _bulkLen - 1) % _bulkLen] != '\n';
+        room -= len;
+    }
+    if (!session.bulkPartial) // Output ended on a line boundary, put the prompt and the typed line back
+    {
+        char out[RXBUFFLEN + 24];
+        _clients[clientID].write((const uint8_t *)out, _editRedraw(session, out) - out);
+    }
+}
+
+//////////////////////////////////////////////////////
+// Multi-producer log queue support functions
+//////////////////////////////////////////////////////
+//
+// postLog() may be called from interrupts, timer callbacks or other threads.  On the ESP8266 producers claim a record
+// inside a short xt_rsil(15) critical section, the lx106 has no compare and swap instruction so std::atomic
+// read-modify-write calls become out of line __atomic_* library calls that are not in IRAM.  There is only one core, so
+// with interrupts off nothing else can run.  Elsewhere, where there may be several cores, the record is claimed with a
+// compare and swap.  The text is then copied in and the record published by advancing its sequence number, a plain
+// aligned 32 bit store.  Only action() takes records out so the consumer side needs nothing beyond the sequence number.
+// Nothing blocks, allocates or formats on the producer side, if the queue is full the record is dropped and counted.
+//
+//////////////////////////////////////////////////////
+
+// Queue a pre-formatted, RAM resident, log line.  Returns false if the queue was full and the line was dropped
+bool IRAM_ATTR SimpleTelnet::postLog(const char *text)
+{
+    return postLog(LOGLEVEL_INFO, LOGTOPIC_GENERAL, text);
+}
+
+// As above for a line on topic at level.  Returns true without queueing the line if nobody is subscribed to it
+bool IRAM_ATTR SimpleTelnet::postLog(byte level, byte topic, const char *text)
+{
+    if (level >= LOGLEVELS || topic >= LOGTOPICS || !(_subscribed[level] & (1UL << topic)))
+        return true; // Nobody wants it, don't use up a record
+    LogRecord *rec;
+#ifdef ARDUINO_ARCH_ESP8266
+    uint32_t savedPS = xt_rsil(15); // Keep interrupts out for the few instructions it takes to claim a record
+    uint32_t pos = _logEnqueuePos.load(std::memory_order_relaxed);
+    rec = &_logQueue[pos & (LOGQUEUELEN - 1)];
+    if (rec->seq.load(std::memory_order_acquire) != pos) // Queue is full
+    {
+        _logDrops.store(_logDrops.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        xt_wsr_ps(savedPS);
+        return false;
+    }
+    _logEnqueuePos.store(pos + 1, std::memory_order_relaxed);
+    xt_wsr_ps(savedPS);
+#else
+    uint32_t pos = _logEnqueuePos.load(std::memory_order_relaxed);
+    while (true)
+    {
+        rec = &_logQueue[pos & (LOGQUEUELEN - 1)];
+        int32_t diff = (int32_t)(rec->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) // Record is free, try to claim it
+        {
+            if (_logEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) // Queue is full
+        {
+            _logDrops.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else // Another producer beat us to it, try the next position
+            pos = _logEnqueuePos.load(std::memory_order_relaxed);
+    }
+#endif
+
+    byte i = 0;
+    while (i < LOGRECLEN - 1 && text[i]) // Copy inline, strcpy() and friends live in flash
+    {
+        rec->text[i] = text[i];
+        i++;
+    }
+    rec->text[i] = '\0';
+    rec->level = level;
+    rec->topic = topic;
+    rec->seq.store(pos + 1, std::memory_order_release); // Publish the record to action()
+    return true;
+}
+
+// Returns the number of log records dropped because the queue was full
+uint32_t SimpleTelnet::getLogDrops(void)
+{
+    return _logDrops.load(std::memory_order_relaxed);
+}
+
+// Move any published log records onto the clients bulk output lanes
+void SimpleTelnet::_drainLog(void)
+{
+    for (auto n = 0; n < LOGQUEUELEN; n++) // Limit the work done per call
+    {
+        LogRecord *rec = &_logQueue[_logDequeuePos & (LOGQUEUELEN - 1)];
+        if (rec->seq.load(std::memory_order_acquire) != _logDequeuePos + 1)
+            break;      // Queue empty or the next record is still being written
+        if (_logStamps) // Stamped as it is sent, formatting the time isn't safe where the record was posted
+        {
+            char line[LOGLINELEN];
+            int len = snprintf_P(line, sizeof(line), PSTR("%s%s"), telnetClock.stamp(), rec->text);
+            _broadcastLine(line, len < LOGLINELEN ? len : LOGLINELEN - 1, rec->level, rec->topic);
+        }
+        else
+            _broadcastLine(rec->text, strlen(rec->text), rec->level, rec->topic);
+        rec->seq.store(_logDequeuePos + LOGQUEUELEN, std::memory_order_release); // Hand the record back to the producers
+        _logDequeuePos++;
+    }
+}
+
+//////////////////////////////////////////////////////
+// Raw upload support functions
+//////////////////////////////////////////////////////
+//
+// The upload command switches a session into raw receive mode for a given number of bytes.  In raw mode received data
+// is read in RAWCHUNKLEN blocks and passed straight to the upload sink without going through _parseChar(), once all
+// the bytes have arrived the optional crc32 is checked and the session returns to the command prompt.
+//
+//////////////////////////////////////////////////////
+
+// Register the function that will receive raw uploads, NULL disables the upload command
+void SimpleTelnet::setUploadSink(void (*sink)(byte cID, const uint8_t *data, uint16_t len, byte status))
+{
+    _uploadSink = sink;
+}
+
+// Update a crc32 (IEEE 802.3, as used by zlib) with len bytes of data, uses a 16 entry table to save memory
+static uint32_t _crc32Update(uint32_t crc, const uint8_t *data, uint16_t len)
+{
+    static const uint32_t crcTable[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+    while (len--)
+    {
+        crc ^= *data++;
+        crc = (crc >> 4) ^ crcTable[crc & 0x0F];
+        crc = (crc >> 4) ^ crcTable[crc & 0x0F];
+    }
+    return crc;
+}
+
+// Read whatever upload data is available and pass it to the sink
+void SimpleTelnet::_receiveRaw(byte clientID)
+{
+    TelnetSession &session = _sessions[clientID];
+    uint8_t chunk[RAWCHUNKLEN];
+    for (auto n = 0; n < RAWMAXCHUNKS && session.rawRemaining; n++) // Limit the time spent per call
+    {
+        int avail = _clients[clientID].available();
+        if (avail <= 0)
+            break;
+        uint16_t len = avail < RAWCHUNKLEN ? avail : RAWCHUNKLEN;
+        if (len > session.rawRemaining)
+            len = session.rawRemaining;
+        len = _clients[clientID].read(chunk, len);
+        if (!len)
+            break;
+        session.connectionTimer = millis(); // Reset timeout timer
+        session.timeoutWarning = false;
+
+        uint8_t *data = chunk;
+        if (session.rawSkipEol) // Drop the rest of the upload command line ending
+        {
+            session.rawSkipEol = false;
+            if (chunk[0] == '\n' || chunk[0] == '\0')
+            {
+                data++;
+                len--;
+            }
+        }
+        if (len)
+        {
+            session.rawCrc = _crc32Update(session.rawCrc, data, len);
+            session.rawRemaining -= len;
+            _uploadSink(clientID, data, len, UPLOAD_DATA);
+        }
+    }
+
+    if (!session.rawRemaining) // All received
+    {
+        uint32_t crc = ~session.rawCrc;
+        if (session.rawCheckCrc && crc != session.rawExpectedCrc)
+        {
+            _clients[clientID].printf_P(PSTR("Upload failed, crc %08X expected %08X\r\n"), crc, session.rawExpectedCrc);
+            _endUpload(clientID, UPLOAD_FAILED);
+        }
+        else
+        {
+            _clients[clientID].printf_P(PSTR("Upload complete, %u bytes, crc %08X\r\n"), session.rawLength, crc);
+            _endUpload(clientID, UPLOAD_DONE);
+        }
+        _clients[clientID].print(F("\r>")); // Back to the command prompt
+    }
+    else if (millis() - session.connectionTimer > RAWTIMEOUT)
+    {
+        _clients[clientID].printf_P(PSTR("Upload timed out, %u bytes missing\r\n"), session.rawRemaining);
+        _endUpload(clientID, UPLOAD_FAILED);
+        _clients[clientID].print(F("\r>")); // Back to the command prompt
+    }
+}
+
+// Return the session to line mode and tell the sink how the upload ended
+void SimpleTelnet::_endUpload(byte clientID, byte status)
+{
+    _sessions[clientID].rawRemaining = 0;
+    if (_uploadSink)
+        _uploadSink(clientID, NULL, 0, status);
+}
+
+//////////////////////////////////////////////////////
+// Journal support functions
+//////////////////////////////////////////////////////
+//
+// Log output is also appended to a journal on the filesystem so it survives a reset.  The journal is a set of segment
+// files, /journal/<seq>.log, each grown to JOURNALSEGSIZE before the next is started and the oldest removed.  Lines
+// are batched in RAM and written when the buffer fills or JOURNALFLUSHTIME passes, to limit flash wear and write stalls.
+//
+//////////////////////////////////////////////////////
+
+// Start the journal on an already mounted filesystem, e.g. LittleFS. Returns false if the journal can't be opened
+bool SimpleTelnet::beginJournal(fs::FS &fs)
+{
+    char path[24];
+    bool found = false;
+
+    if (!_journalBuff)
+        _journalBuff = (char *)malloc(JOURNALBUFFLEN);
+    if (!_journalBuff)
+        return false;
+    _journalFS = &fs;
+    _journalFirst = 0;
+    _journalSeq = 0;
+    _journalLen = 0;
+    _journalTimer = millis();
+    fs::Dir dir = fs.openDir("/journal");
+    while (dir.next()) // Find the oldest and newest segments
+    {
+        uint32_t seq = strtoul(dir.fileName().c_str(), NULL, 10);
+        if (!found || seq < _journalFirst)
+            _journalFirst = seq;
+        if (!found || seq > _journalSeq)
+            _journalSeq = seq;
+        found = true;
+    }
+    _journalFile = fs.open(_journalPath(path, _journalSeq), "a");
+    if (!_journalFile)
+    {
+        _journalFS = NULL;
+        return false;
+    }
+    char line[LOGLINELEN];
+    int len = snprintf_P(line, sizeof(line), PSTR("*** Boot, %s ***\r\n"), ESP.getResetReason().c_str()); // Mark the reset in the journal
+    if (len > 0 && len < LOGLINELEN)
+        _journalLine(line, len);
+    _updateSubscriptions(); // The journal wants everything from JOURNALLEVEL up
+    return true;
+}
+
+// Build the file name of journal segment seq
+char *SimpleTelnet::_journalPath(char *buff, uint32_t seq)
+{
+    sprintf_P(buff, PSTR("/journal/%u.log"), seq);
+    return buff;
+}
+
+// Add a log line to the journal batch buffer
+void SimpleTelnet::_journalLine(const char *line, uint16_t len)
+{
+    if (!_journalFS)
+        return;
+    if (_journalLen + len > JOURNALBUFFLEN)
+        flushJournal();
+    if (len > JOURNALBUFFLEN)
+        len = JOURNALBUFFLEN;
+    memcpy(&_journalBuff[_journalLen], line, len);
+    _journalLen += len;
+}
+
+// Write the batched journal data to flash, moving on to a new segment if the current one is full
+void SimpleTelnet::flushJournal(void)
+{
+    _journalTimer = millis();
+    if (!_journalFS || !_journalLen)
+        return;
+    _journalFile.write((const uint8_t *)_journalBuff, _journalLen);
+    _journalFile.flush();
+    _journalLen = 0;
+
+    if (_journalFile.size() >= JOURNALSEGSIZE) // Segment full, rotate
+    {
+        char path[24];
+        _journalFile.close();
+        _journalSeq++;
+        _journalFile = _journalFS->open(_journalPath(path, _journalSeq), "a");
+        while (_journalSeq - _journalFirst >= JOURNALSEGMENTS) // Remove the oldest segments
+            _journalFS->remove(_journalPath(path, _journalFirst++));
+    }
+}
+
+// Start sending the journal to a client, either all of it or just the last lines
+void SimpleTelnet::_startDump(byte clientID, uint32_t lines)
+{
+    TelnetSession &session = _sessions[clientID];
+    char path[24];
+    char buff[64];
+
+    flushJournal(); // Make sure everything is in the files
+    session.dumpSeg = _journalFirst;
+    session.dumpPos = 0;
+    session.dumpEndSeg = _journalSeq;
+    session.dumpEndPos = _journalFile.size();
+
+    uint32_t seg = _journalSeq;
+    uint32_t count = 0;
+    while (lines) // Search back from the end of the journal for the start of the last lines
+    {
+        fs::File f = _journalFS->open(_journalPath(path, seg), "r");
+        uint32_t pos = 0;
+        if (f) // Start from the end of the segment, or where the dump will stop for the current segment
+            pos = seg == _journalSeq ? session.dumpEndPos : f.size();
+        while (pos)
+        {
+            uint16_t len = pos < sizeof(buff) ? pos : sizeof(buff);
+            pos -= len;
+            f.seek(pos, fs::SeekSet);
+            f.read((uint8_t *)buff, len);
+            for (int k = len - 1; k >= 0; k--)
+            {
+                if (buff[k] == '\n' && count++ == lines) // Found the end of the line before the ones we want
+                {
+                    session.dumpSeg = seg;
+                    session.dumpPos = pos + k + 1;
+                    lines = 0;
+                    break;
+                }
+            }
+            if (!lines)
+                break;
+        }
+        if (f)
+            f.close();
+        if (seg == _journalFirst)
+            break; // Fewer lines in the journal than asked for, send all of it
+        seg--;
+    }
+    session.dumpActive = true;
+}
+
+// Send the next block of the journal to a client as tx space allows, any key cancels
+void SimpleTelnet::_sendJournal(byte clientID)
+{
+    TelnetSession &session = _sessions[clientID];
+    char path[24];
+    uint8_t buff[JOURNALCHUNK];
+
+    if (_clients[clientID].available()) // Key pressed, cancel the output
+    {
+        while (_clients[clientID].available())
+            _clients[clientID].read();
+        session.dumpActive = false;
+        if (session.dumpFile)
+            session.dumpFile.close();
+        _clients[clientID].print(F("\r\nJournal output cancelled\r\n\r>"));
+        return;
+    }
+    int room = _clients[clientID].availableForWrite();
+    if (room <= 0)
+        return; // Wait for the client to catch up
+    if (room > JOURNALCHUNK)
+        room = JOURNALCHUNK;
+
+    int len = 0;
+    bool lastSeg = session.dumpSeg == session.dumpEndSeg;
+    if (lastSeg && session.dumpPos + room > session.dumpEndPos)
+        room = session.dumpEndPos - session.dumpPos;
+    if (room > 0)
+    {
+        if (!session.dumpFile) // Starting a segment, open it once rather than on every call
+        {
+            session.dumpFile = _journalFS->open(_journalPath(path, session.dumpSeg), "r");
+            if (session.dumpFile && !session.dumpFile.seek(session.dumpPos, fs::SeekSet))
+                session.dumpFile.close();
+        }
+        if (session.dumpFile)
+            len = session.dumpFile.read(buff, room);
+    }
+    if (len > 0)
+    {
+        _clients[clientID].write(buff, len);
+        session.dumpPos += len;
+    }
+    else if (lastSeg) // All sent
+    {
+        session.dumpActive = false;
+        if (session.dumpFile)
+            session.dumpFile.close();
+        _clients[clientID].print(F("\r\n\r>"));
+    }
+    else // End of this segment, move on to the next
+    {
+        if (session.dumpFile)
+            session.dumpFile.close();
+        session.dumpSeg++;
+        session.dumpPos = 0;
+    }
+}
+
 //////////////////////////////////////////////////////
 // Linked list support functions
 //////////////////////////////////////////////////////
 
-bool SimpleTelnet::_ProcessList(char *command, byte cID) // Search the list for thie command in command parm
+//////////////////////////////////////////////////////
+// Runs a command line.  Several commands can be separated by ; and are run in turn, each with a header and status line
+//////////////////////////////////////////////////////
+bool SimpleTelnet::_runCommands(char *line, byte cID, byte depth, byte parent)
+{
+    TelnetSession &session = _sessions[cID];
+    byte count = 0;  // Commands run
+    byte failed = 0; // Commands not recognised
+    char prefix[5];  // Number of the batch command running this macro, keeps its numbering apart from the batch's
+
+    if (parent)
+        sprintf_P(prefix, PSTR("%d."), parent);
+    else
+        prefix[0] = '\0';
+
+    if (!depth && !_nextCommand(line)) // Single command, reply without any delimiters
+    {
+        if (!_ProcessList(line, cID, depth, 0))
+        {
+            _clients[cID].print(F(">What?\r\n")); // print new prompt
+            return false;
+        }
+        _clients[cID].print(F("\r\n")); // crlf ready for the next output
+        return true;
+    }
+
+    while (line) // Split the line at each ; without strtok() as the handlers use it
+    {
+        char *next = _nextCommand(line);
+        if (next)
+            *next++ = '\0';
+        while (*line == ' ') // Trim the command
+            line++;
+        for (char *end = line + strlen(line); end > line && end[-1] == ' '; end--)
+            end[-1] = '\0';
+        if (*line)
+        {
+            count++;
+            _clients[cID].printf_P(PSTR("[%s%d] %s\r\n"), prefix, count, line);
+            if (_ProcessList(line, cID, depth, count))
+                _clients[cID].printf_P(PSTR("\r\n[%s%d] OK\r\n"), prefix, count);
+            else
+            {
+                failed++;
+                _clients[cID].printf_P(PSTR("[%s%d] What?\r\n"), prefix, count);
+            }
+            if (!_clients[cID].connected() || session.rawRemaining || session.dumpActive)
+                return !failed; // Session ended or left line mode, abandon the rest of the commands
+        }
+        line = next;
+    }
+    _clients[cID].printf_P(PSTR("[%sEND] %d commands, %d failed\r\n"), prefix, count, failed);
+    return !failed;
+}
+
+// Find the ; that ends the first command in line, a ; inside double quotes doesn't count.  Returns NULL if there isn't one
+char *SimpleTelnet::_nextCommand(char *line)
+{
+    bool quoted = false;
+    for (; *line; line++)
+    {
+        if (*line == '"')
+            quoted = !quoted;
+        else if (*line == ';' && !quoted)
+            return line;
+    }
+    return NULL;
+}
+
+bool SimpleTelnet::_ProcessList(char *command, byte cID, byte depth, byte parent) // Search the list for thie command in command parm
+{
+    Node *flist = _matchCommand(command);
+    if (!flist)
+        return false; // failed to match the command
+
+    if (flist->commandMacro) // Run the macro commands
+    {
+        char macro[MACROLEN];
+        if (depth)
+        {
+            _clients[cID].print(F("Macros can't run other macros\r\n"));
+            return false; // Report it as failed, not run
+        }
+        else
+        {
+            strncpy_P(macro, flist->commandMacro, sizeof(macro) - 1); // Take a copy the handlers can modify
+            macro[sizeof(macro) - 1] = '\0';
+            _runCommands(macro, cID, depth + 1, parent);
+        }
+    }
+    else if (flist->commandAction)          // Check we have a function attached
+        flist->commandAction(cID, command); // Run command
+    return true;                            // indicate that we matched the command
+}
+
+// Find the node that matches the command entered, NULL if none
+Node *SimpleTelnet::_matchCommand(const char *command)
 {
     Node *flist = head;
     while (flist != NULL) // Traverse the list.
@@ -363,14 +1417,10 @@ bool SimpleTelnet::_ProcessList(char *command, byte cID) // Search the list for
         else
             cresult = strcmp_P(command, flist->commandText); // s2 is in PROGMEM, rets 0 if matched
         if (!cresult)                                        // Check for command match
-        {
-            if (flist->commandAction)               // Check we have a function attached
-                flist->commandAction(cID, command); // Run command
-            return true;                            // indicate that we matched the command
-        }
+            break;
         flist = flist->next; // Iterate to next member
     }
-    return false; // failed to match the command
+    return flist;
 }
 
 // Compare two strings in flash, compatible with strcmp(), needed because user can override commands in flash
@@ -418,6 +1468,7 @@ void SimpleTelnet::insertNode(const char *commandtext, const char *helptext, voi
         enode->commandAction = action;
         enode->commandHelp = helptext;
         enode->commandText = commandtext;
+        enode->commandMacro = NULL;
         enode->matchlen = matchLen;
         return;
     }
@@ -435,13 +1486,32 @@ void SimpleTelnet::insertNode(const char *commandtext, const char *helptext, voi
     temp->next = newNode;  // Insert the new node at the last.
 }
 
+// Unlink a node from the list and delete it, any heap text it owns is left for the caller to free
+void SimpleTelnet::_removeNode(Node *node)
+{
+    Node **link = &head;
+    while (*link && *link != node) // Find the pointer to the node
+        link = &(*link)->next;
+    if (!*link)
+        return;
+    *link = node->next;
+    delete node;
+}
+
+// Adds a macro to the list.  P1 = name, P2 = Help message to display, P3 = ; separated commands to run
+void SimpleTelnet::addMacro(const char *name, const char *helptext, const char *commands)
+{
+    insertNode(name, helptext, NULL);
+    _findCommand(name)->commandMacro = commands;
+}
+
 void SimpleTelnet::printList(byte clientID)
 {
     Node *flist = head;
     while (flist != NULL) // Traverse the list.
     {
         if (strlen_P(flist->commandHelp)) // Only list the command if there is some help text assosiated, this allows aliases to be defined
-            telnetClients[clientID].printf_P(PSTR("%s%10s%s\t%s\r\n"), COLOUR_YELLOW, FPSTR(flist->commandText), COLOUR_RESET, FPSTR(flist->commandHelp));
+            _clients[clientID].printf_P(PSTR("%s%10s%s\t%s\r\n"), COLOUR_YELLOW, FPSTR(flist->commandText), COLOUR_RESET, FPSTR(flist->commandHelp));
         flist = flist->next; // Iterate to next member
     }
 }
@@ -451,7 +1521,7 @@ void SimpleTelnet::printList(byte clientID)
 //////////////////////////////////////////////////////
 void SimpleTelnet::setTimeout(byte clientID, uint16_t tmins)
 {
-    _connectionTimeout[clientID] = tmins * 60 * 1000;
+    _sessions[clientID].connectionTimeout = tmins * 60 * 1000;
 }
 
 //////////////////////////////////////////////////////
@@ -459,10 +1529,11 @@ void SimpleTelnet::setTimeout(byte clientID, uint16_t tmins)
 //////////////////////////////////////////////////////
 uint16_t SimpleTelnet::getTimeout(byte clientID)
 {
-    if (_connectionTimeout[clientID])
+    TelnetSession &session = _sessions[clientID];
+    if (session.connectionTimeout)
     {
-        time_t elapsed = millis() - _connectionTimer[clientID];
-        time_t remaining = _connectionTimeout[clientID] - elapsed;
+        time_t elapsed = millis() - session.connectionTimer;
+        time_t remaining = session.connectionTimeout - elapsed;
         return (uint16_t)round((double)(remaining / 60000.0));
     }
     else
@@ -470,17 +1541,79 @@ uint16_t SimpleTelnet::getTimeout(byte clientID)
 }
 
 //////////////////////////////////////////////////////
-// Return the time_t passed since last boot.
+// Time stamp cache
+//////////////////////////////////////////////////////
+//
+// Formatting a time with the libc functions is slow, so the strings are only rebuilt when the second changes and are
+// then handed out ready to send.  The stamp() milliseconds are patched into the cached string on each call.
+//
 //////////////////////////////////////////////////////
-time_t SimpleTelnet::_uptime(void) // Returns the seconds elapsed since boot
+TelnetClock::TelnetClock(void)
+{
+    _second = -1;
+    _upSecond = UINT32_MAX;
+    _clock[0] = '\0';
+    _uptime[0] = '\0';
+    strcpy_P(_stamp, PSTR("00:00:00.000 "));
+}
+
+// Rebuild the wall clock strings if the second has changed
+void TelnetClock::_refresh(void)
+{
+    timeval tv;
+    gettimeofday(&tv, nullptr);
+    _millis = tv.tv_usec / 1000;
+    if (tv.tv_sec == _second)
+        return;
+    _second = tv.tv_sec;
+    tm tm;
+    localtime_r(&_second, &tm);
+    asctime_r(&tm, _clock);
+    _clock[24] = '\0';              // Remove the trailing newline
+    memcpy(_stamp, &_clock[11], 8); // hh:mm:ss
+}
+
+const char *TelnetClock::wallClock(void)
+{
+    _refresh();
+    return _clock;
+}
+
+const char *TelnetClock::stamp(void)
 {
-    return now() - _bootTime;
+    _refresh();
+    _stamp[9] = '0' + _millis / 100;
+    _stamp[10] = '0' + _millis / 10 % 10;
+    _stamp[11] = '0' + _millis % 10;
+    return _stamp;
 }
 
-time_t SimpleTelnet::now(void)
+uint32_t TelnetClock::uptimeSecs(void)
 {
-    _timeNow = time(nullptr);
-    return _timeNow;
+    return micros64() / 1000000; // micros64() doesn't wrap like millis()
+}
+
+const char *TelnetClock::uptime(void)
+{
+    uint32_t secs = uptimeSecs();
+    if (secs == _upSecond)
+        return _uptime;
+    _upSecond = secs;
+
+    const char *pl = "s"; // plural
+    uint32_t days = secs / 86400;
+    byte hours = secs / 3600 % 24;
+    byte mins = secs / 60 % 60;
+    secs %= 60;
+    char *p = _uptime;
+    if (days)
+        p += sprintf_P(p, PSTR("%u Day%s, "), days, days > 1 ? pl : "");
+    if (hours)
+        p += sprintf_P(p, PSTR("%d Hour%s, "), hours, hours > 1 ? pl : "");
+    if (mins)
+        p += sprintf_P(p, PSTR("%d Minute%s & "), mins, mins == 1 ? "" : pl);
+    sprintf_P(p, PSTR("%u Second%s"), secs, secs == 1 ? "" : pl);
+    return _uptime;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -493,33 +1626,6 @@ time_t SimpleTelnet::now(void)
 //
 //////////////////////////////////////////////////////////////////////////////////////////////////////
 
-//////////////////////////////////////////////////////
-// Prints an elapsed time in seconds to buff.  Note buff should be at least 80 chars long
-//////////////////////////////////////////////////////
-char *_printElapsedTime(char *buff, time_t elapsedTime)
-{
-    tm tm;                // Struct to store time parts
-    const char *pl = "s"; // plural
-
-    gmtime_r(&elapsedTime, &tm);
-    tm.tm_mday--;     // days start at 1
-    tm.tm_year -= 70; // year is returned offset from 1900
-
-    buff[0] = '\0';
-    if (tm.tm_year)
-        sprintf_P(buff, PSTR("%d Year%s, "), tm.tm_year, tm.tm_year > 1 ? pl : "");
-    if (tm.tm_mon)
-        sprintf_P(buff + strlen(buff), PSTR("%d Month%s, "), tm.tm_mon, tm.tm_mon > 1 ? pl : "");
-    if (tm.tm_mday)
-        sprintf_P(buff + strlen(buff), PSTR("%d Day%s, "), tm.tm_mday, tm.tm_mday > 1 ? pl : "");
-    if (tm.tm_hour)
-        sprintf_P(buff + strlen(buff), PSTR("%d Hour%s, "), tm.tm_hour, tm.tm_hour > 1 ? pl : "");
-    if (tm.tm_min)
-        sprintf_P(buff + strlen(buff), PSTR("%d Minute%s & "), tm.tm_min, tm.tm_min == 1 ? "" : pl);
-    sprintf_P(buff + strlen(buff), PSTR("%d Second%s"), tm.tm_sec, tm.tm_sec == 1 ? "" : pl);
-    return buff;
-}
-
 //////////////////////////////////////////////////////
 // Remove the trailing newline from the time string
 //////////////////////////////////////////////////////
@@ -533,10 +1639,11 @@ char *_cleanAsctime(char *timeStr)
 //////////////////////////////////////////////////////
 void _showHelpMessage(byte clientID, char *buff)
 {
-    time_t now = time(nullptr);
-    telnetClients[clientID].printf_P(PSTR("[Client %d] Menu options.-\r\n"), clientID + 1);
-    telnetClients[clientID].printf_P(PSTR("Current time is %s\r"), asctime(localtime(&now)));
-    telnetServer.printList(clientID);
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
+    client.printf_P(PSTR("[Client %d] Menu options.-\r\n"), clientID + 1);
+    client.printf_P(PSTR("Current time is %s\r\n"), telnetClock.wallClock());
+    ts.printList(clientID);
 }
 
 //////////////////////////////////////////////////////
@@ -544,37 +1651,39 @@ void _showHelpMessage(byte clientID, char *buff)
 //////////////////////////////////////////////////////
 void _telnetInfo(byte clientID, char *buff)
 {
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
     IPAddress ip;
-    char timeBuff[80];
-    telnetClients[clientID].printf_P(PSTR("This is %s %s - system info:\r\n"), __PROJECT, __VERSION_SHORT);
-    telnetClients[clientID].printf_P(PSTR("\tMCU: Flash id 0x%06X:0x%06X\r\n"), ESP.getChipId(), ESP.getFlashChipId());
-    telnetClients[clientID].printf_P(PSTR("\tLast boot code%s:\r\n"), ESP.getResetReason().c_str());
-    telnetClients[clientID].printf_P(PSTR("\tLast boot time %sz\r\n"), _cleanAsctime(asctime(gmtime(&telnetServer._bootTime))));
-    telnetClients[clientID].printf_P(PSTR("\tUptime %s\r\n"), _printElapsedTime(timeBuff, telnetServer.now() - telnetServer._bootTime));
-    telnetClients[clientID].printf_P(PSTR("\tFlash size %u\r\n"), ESP.getFlashChipRealSize());
-    telnetClients[clientID].printf_P(PSTR("\tFree cont stack  %u\r\n"), ESP.getFreeContStack());
-    telnetClients[clientID].printf_P(PSTR("\tFree memory (heap) %u\r\n"), ESP.getFreeHeap());
-    telnetClients[clientID].printf_P(PSTR("\tMax free block size %u\r\n"), ESP.getMaxFreeBlockSize());
-    telnetClients[clientID].printf_P(PSTR("\tHeap fragmentation %u%%\r\n"), ESP.getHeapFragmentation());
-    telnetClients[clientID].printf_P(PSTR("\tFree sketch space %u\r\n"), ESP.getFreeSketchSpace());
-    telnetClients[clientID].printf_P(PSTR("\tHostname %s\r\n"), WiFi.hostname().c_str());
-    telnetClients[clientID].print(F("\tIP Address "));
-    WiFi.localIP().printTo(telnetClients[clientID]);
-    telnetClients[clientID].print(F("\r\n\tIP Mask    "));
-    WiFi.subnetMask().printTo(telnetClients[clientID]);
-    telnetClients[clientID].print(F("\r\n\tIP Gateway "));
-    WiFi.gatewayIP().printTo(telnetClients[clientID]);
-    telnetClients[clientID].print(F("\r\n\tDNS server "));
-    WiFi.dnsIP().printTo(telnetClients[clientID]);
-    telnetClients[clientID].print(F("\r\n\tYour IP    "));
-    telnetClients[clientID].remoteIP().printTo(telnetClients[clientID]);
-    telnetClients[clientID].printf_P(PSTR(":%d\r\n"), telnetClients[clientID].remotePort());
-    telnetClients[clientID].printf_P(PSTR("\tMAC address %s\r\n"), WiFi.macAddress().c_str());
-    telnetClients[clientID].printf_P(PSTR("\tSSID %s\r\n"), WiFi.SSID().c_str());
-    telnetClients[clientID].printf_P(PSTR("\tRSSI %ddBm\r\n"), WiFi.RSSI());
+    client.printf_P(PSTR("This is %s %s - system info:\r\n"), __PROJECT, __VERSION_SHORT);
+    client.printf_P(PSTR("\tMCU: Flash id 0x%06X:0x%06X\r\n"), ESP.getChipId(), ESP.getFlashChipId());
+    client.printf_P(PSTR("\tLast boot code%s:\r\n"), ESP.getResetReason().c_str());
+    client.printf_P(PSTR("\tLast boot time %sz\r\n"), _cleanAsctime(asctime(gmtime(&ts._bootTime))));
+    client.printf_P(PSTR("\tUptime %s\r\n"), telnetClock.uptime());
+    client.printf_P(PSTR("\tFlash size %u\r\n"), ESP.getFlashChipRealSize());
+    client.printf_P(PSTR("\tFree cont stack  %u\r\n"), ESP.getFreeContStack());
+    client.printf_P(PSTR("\tFree memory (heap) %u\r\n"), ESP.getFreeHeap());
+    client.printf_P(PSTR("\tMax free block size %u\r\n"), ESP.getMaxFreeBlockSize());
+    client.printf_P(PSTR("\tHeap fragmentation %u%%\r\n"), ESP.getHeapFragmentation());
+    client.printf_P(PSTR("\tFree sketch space %u\r\n"), ESP.getFreeSketchSpace());
+    client.printf_P(PSTR("\tHostname %s\r\n"), WiFi.hostname().c_str());
+    client.print(F("\tIP Address "));
+    WiFi.localIP().printTo(client);
+    client.print(F("\r\n\tIP Mask    "));
+    WiFi.subnetMask().printTo(client);
+    client.print(F("\r\n\tIP Gateway "));
+    WiFi.gatewayIP().printTo(client);
+    client.print(F("\r\n\tDNS server "));
+    WiFi.dnsIP().printTo(client);
+    client.print(F("\r\n\tYour IP    "));
+    client.remoteIP().printTo(client);
+    client.printf_P(PSTR(":%d\r\n"), client.remotePort());
+    client.printf_P(PSTR("\tMAC address %s\r\n"), WiFi.macAddress().c_str());
+    client.printf_P(PSTR("\tSSID %s\r\n"), WiFi.SSID().c_str());
+    client.printf_P(PSTR("\tRSSI %ddBm\r\n"), WiFi.RSSI());
     uint16_t vcc = ESP.getVcc();
     if (vcc != 65535) // ADC_MODE(ADC_VCC) not set
-        telnetClients[clientID].printf_P(PSTR("\tVCC %.3f Volts\r\n"), (float)vcc / 1000.0);
+        client.printf_P(PSTR("\tVCC %.3f Volts\r\n"), (float)vcc / 1000.0);
+    client.printf_P(PSTR("\tLog queue drops %u\r\n"), ts.getLogDrops());
 }
 
 //////////////////////////////////////////////////////
@@ -582,8 +1691,10 @@ void _telnetInfo(byte clientID, char *buff)
 //////////////////////////////////////////////////////
 void _telnetWiFiinfo(byte clientID, char *buff)
 {
-    telnetClients[clientID].printf_P(PSTR("This is %s %s - WiFi status:\r\n"), __PROJECT, __VERSION_SHORT);
-    WiFi.printDiag(telnetClients[clientID]);
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
+    client.printf_P(PSTR("This is %s %s - WiFi status:\r\n"), __PROJECT, __VERSION_SHORT);
+    WiFi.printDiag(client);
 }
 
 //////////////////////////////////////////////////////
@@ -591,9 +1702,13 @@ void _telnetWiFiinfo(byte clientID, char *buff)
 //////////////////////////////////////////////////////
 void _telnetReboot(byte clientID, char *buff)
 {
-    telnetClients[clientID].println(F("* Reset ...\r\n* Closing telnet connection ...\r\n* Resetting the ESP8266 ..."));
-    telnetClients[clientID].stop();
-    _telnetServer.stop();
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
+    client.println(F("* Reset ...\r\n* Closing telnet connection ...\r\n* Resetting the ESP8266 ..."));
+    ts.broadcast(LOGLEVEL_WARN, LOGTOPIC_GENERAL, PSTR("*** Reboot requested by client [%d] ***\r\n"), clientID + 1);
+    ts.flushJournal(); // Keep the log context through the reset
+    client.stop();
+    ts._server->stop();
     delay(500);    // Give it time to stop
     ESP.restart(); // reboot
 }
@@ -603,13 +1718,15 @@ void _telnetReboot(byte clientID, char *buff)
 //////////////////////////////////////////////////////
 void _listSessions(byte clientID, char *buff)
 {
-    for (auto i = 0; i < MAXCLIENTS; i++)
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
+    for (auto i = 0; i < ts.maxClients(); i++)
     {
-        if (telnetClients[i].connected())
+        if (ts.client(i).connected())
         {
-            telnetClients[clientID].printf_P(PSTR("\tClient [%d] IP "), i + 1);
-            telnetClients[i].remoteIP().printTo(telnetClients[clientID]);
-            telnetClients[clientID].printf_P(PSTR(":%d (T:%02d)%c\r\n"), telnetClients[i].remotePort(), telnetServer.getTimeout(i), clientID == i ? '*' : ' ');
+            client.printf_P(PSTR("\tClient [%d] IP "), i + 1);
+            ts.client(i).remoteIP().printTo(client);
+            client.printf_P(PSTR(":%d (T:%02d)%c\r\n"), ts.client(i).remotePort(), ts.getTimeout(i), clientID == i ? '*' : ' ');
         }
     }
 }
@@ -619,6 +1736,8 @@ void _listSessions(byte clientID, char *buff)
 //////////////////////////////////////////////////////
 void _setParm(byte clientID, char *buff)
 {
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
     char *cmd; // Pointer to the set command
     char *p1;  // Pointer to the command parameter
     bool cmdInvalid = true;
@@ -636,8 +1755,8 @@ void _setParm(byte clientID, char *buff)
                     int tmins = atoi(p1);
                     if (tmins >= 0)
                     {
-                        telnetServer.setTimeout(clientID, tmins);
-                        telnetClients[clientID].printf_P(PSTR("\tInactivity timeout set to %d minutes"), tmins);
+                        ts.setTimeout(clientID, tmins);
+                        client.printf_P(PSTR("\tInactivity timeout set to %d minutes"), tmins);
                         cmdInvalid = false;
                     }
                 }
@@ -645,7 +1764,7 @@ void _setParm(byte clientID, char *buff)
         }
     }
     if (cmdInvalid)
-        telnetClients[clientID].printf_P(PSTR("Invalid set command\r\n\tUse: set parameter=value\r\n\tSupported commands.-\r\n\ttimeout=minutes"));
+        client.printf_P(PSTR("Invalid set command\r\n\tUse: set parameter=value\r\n\tSupported commands.-\r\n\ttimeout=minutes"));
 }
 
 //////////////////////////////////////////////////////
@@ -653,15 +1772,19 @@ void _setParm(byte clientID, char *buff)
 //////////////////////////////////////////////////////
 void _endSession(byte clientID, char *buff)
 {
-    telnetClients[clientID].print(F("\r\nBye bye, thanks for connecting\r\n"));
-    telnetClients[clientID].flush(); // Flust tx buff
-    telnetClients[clientID].stop();  // Kill session
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
+    client.print(F("\r\nBye bye, thanks for connecting\r\n"));
+    client.flush(); // Flust tx buff
+    client.stop();  // Kill session
 }
 //////////////////////////////////////////////////////
 // Kills a session syntax kill session=X
 //////////////////////////////////////////////////////
 void _killSession(byte clientID, char *buff)
 {
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
     char *cmd; // Pointer to the kill command
     char *p1;  // Pointer to the session parameter
     bool cmdInvalid = true;
@@ -677,11 +1800,11 @@ void _killSession(byte clientID, char *buff)
                 if (p1)
                 {
                     int sessionid = atoi(p1);
-                    if ((sessionid > 0) && (sessionid <= MAXCLIENTS) && telnetClients[sessionid - 1].connected())
+                    if ((sessionid > 0) && (sessionid <= ts.maxClients()) && ts.client(sessionid - 1).connected())
                     {
-                        telnetClients[clientID].printf_P(PSTR("\tSession %d ended forcefully by client [%d]"), sessionid, clientID + 1);
-                        if (sessionid != clientID)
-                            telnetClients[sessionid].printf_P(PSTR("\tSession %d ended forcefully by client [%d]"), sessionid, clientID + 1);
+                        client.printf_P(PSTR("\tSession %d ended forcefully by client [%d]"), sessionid, clientID + 1);
+                        if (sessionid - 1 != clientID)
+                            ts.client(sessionid - 1).printf_P(PSTR("\tSession %d ended forcefully by client [%d]"), sessionid, clientID + 1);
                         _endSession(sessionid - 1, NULL); // Kill the session
                         cmdInvalid = false;
                     }
@@ -691,11 +1814,250 @@ void _killSession(byte clientID, char *buff)
     }
     if (cmdInvalid)
     {
-        telnetClients[clientID].printf_P(PSTR("Invalid kill command or session is not active\r\n\tUse: kill session=value\r\n\tvalue should be between 1 and %d\r\n\tAvailable clients.-\r\n\t"), MAXCLIENTS);
+        client.printf_P(PSTR("Invalid kill command or session is not active\r\n\tUse: kill session=value\r\n\tvalue should be between 1 and %d\r\n\tAvailable clients.-\r\n\t"), ts.maxClients());
         _listSessions(clientID, NULL);
     }
 }
 
+//////////////////////////////////////////////////////
+// Starts a raw upload, syntax upload size=X [crc=Y] where Y is a hex crc32
+//////////////////////////////////////////////////////
+void _startUpload(byte clientID, char *buff)
+{
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
+    TelnetSession &session = ts._sessions[clientID];
+    char *p1; // Pointer to the parameter
+    uint32_t size = 0;
+    bool checkCrc = false;
+    uint32_t crc = 0;
+
+    if (!ts._uploadSink)
+    {
+        client.printf_P(PSTR("Uploads are not supported"));
+        return;
+    }
+    if (strtok(buff, " ")) // skip the command word
+    {
+        while ((p1 = strtok(NULL, " "))) // get each parameter
+        {
+            if (!strncmp_P(p1, PSTR("size="), 5))
+                size = strtoul(p1 + 5, NULL, 10);
+            else if (!strncmp_P(p1, PSTR("crc="), 4))
+            {
+                crc = strtoul(p1 + 4, NULL, 16);
+                checkCrc = true;
+            }
+        }
+    }
+    if (!size)
+    {
+        client.printf_P(PSTR("Invalid upload command\r\n\tUse: upload size=bytes [crc=crc32 in hex]"));
+        return;
+    }
+
+    session.rawLength = size;
+    session.rawRemaining = size;
+    session.rawCrc = 0xFFFFFFFF;
+    session.rawExpectedCrc = crc;
+    session.rawCheckCrc = checkCrc;
+    session.rawSkipEol = true;
+    session.connectionTimer = millis(); // Start the upload timeout
+    client.printf_P(PSTR("Ready for %u bytes"), size);
+}
+
+//////////////////////////////////////////////////////
+// Sends the journal, syntax journal tail X or journal dump
+//////////////////////////////////////////////////////
+void _journalCmd(byte clientID, char *buff)
+{
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
+    char *cmd; // Pointer to the journal command
+    char *p1;  // Pointer to the command parameter
+
+    if (!ts._journalFS)
+    {
+        client.printf_P(PSTR("The journal is not enabled"));
+        return;
+    }
+    if (strtok(buff, " ")) // if we have a space in the buff
+    {
+        cmd = strtok(NULL, " "); // get the cmd word
+        if (cmd)
+        {
+            if (!strcmp_P(cmd, PSTR("dump")))
+            {
+                ts._startDump(clientID, 0);
+                return;
+            }
+            if (!strcmp_P(cmd, PSTR("tail")))
+            {
+                p1 = strtok(NULL, " "); // get the parameter
+                int lines = p1 ? atoi(p1) : 20;
+                if (lines > 0)
+                {
+                    ts._startDump(clientID, lines);
+                    return;
+                }
+            }
+        }
+    }
+    client.printf_P(PSTR("Invalid journal command\r\n\tUse: journal tail [lines] or journal dump"));
+}
+
+//////////////////////////////////////////////////////
+// Sets the log output sent to the session, syntax subscribe [level=X] [topics=all|none|topic,topic...]
+//////////////////////////////////////////////////////
+static const char _levelNames[LOGLEVELS][6] PROGMEM = {"debug", "info", "warn", "error"};
+
+void _subscribe(byte clientID, char *buff)
+{
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
+    TelnetSession &session = ts._sessions[clientID];
+    char *p1; // Pointer to the parameter
+    byte level = session.subLevel;
+    uint32_t topics = session.subTopics;
+    bool cmdInvalid = false;
+
+    if (strtok(buff, " ")) // skip the command word
+    {
+        while ((p1 = strtok(NULL, " "))) // get each parameter
+        {
+            if (!strncmp_P(p1, PSTR("level="), 6))
+            {
+                for (level = 0; level < LOGLEVELS; level++)
+                    if (!strcmp_P(p1 + 6, _levelNames[level]))
+                        break;
+                cmdInvalid |= level == LOGLEVELS;
+            }
+            else if (!strncmp_P(p1, PSTR("topics="), 7))
+            {
+                topics = 0;
+                char *name = p1 + 7;
+                while (name) // Comma separated topic names or numbers
+                {
+                    char *next = strchr(name, ',');
+                    if (next)
+                        *next++ = '\0';
+                    byte topic = ts._findTopic(name);
+                    if (!strcmp_P(name, PSTR("all")))
+                        topics = 0xFFFFFFFF;
+                    else if (!strcmp_P(name, PSTR("none")))
+                        topics = 0;
+                    else if (topic < LOGTOPICS)
+                        topics |= 1UL << topic;
+                    else
+                        cmdInvalid = true;
+                    name = next;
+                }
+            }
+            else
+                cmdInvalid = true;
+        }
+    }
+    if (cmdInvalid)
+    {
+        client.printf_P(PSTR("Invalid subscribe command\r\n\tUse: subscribe [level=debug|info|warn|error] [topics=all|none|topic,topic...]\r\n"));
+        level = session.subLevel; // Show what is still in force
+        topics = session.subTopics;
+    }
+    else
+    {
+        session.subLevel = level;
+        session.subTopics = topics;
+        ts._updateSubscriptions();
+    }
+
+    client.printf_P(PSTR("\tLevel %s and above, topics "), FPSTR(_levelNames[level]));
+    if (topics == 0xFFFFFFFF)
+        client.print(F("all"));
+    else if (!topics)
+        client.print(F("none"));
+    for (auto topic = 0; topic < LOGTOPICS && topics != 0xFFFFFFFF; topic++)
+    {
+        if (!(topics & (1UL << topic)))
+            continue;
+        if (ts._topicNames[topic])
+            client.printf_P(PSTR("%s "), FPSTR(ts._topicNames[topic]));
+        else
+            client.printf_P(PSTR("%d "), topic);
+    }
+    client.print(F("\r\n\tAvailable topics "));
+    for (auto topic = 0; topic < LOGTOPICS; topic++)
+        if (ts._topicNames[topic])
+            client.printf_P(PSTR("%s "), FPSTR(ts._topicNames[topic]));
+}
+
+//////////////////////////////////////////////////////
+// Defines a macro at run time, syntax macro name="command;command..."
+//////////////////////////////////////////////////////
+void _defineMacro(byte clientID, char *buff)
+{
+    SimpleTelnet &ts = SimpleTelnet::current();
+    WiFiClient &client = ts.client(clientID);
+    char *name = strchr(buff, ' '); // Pointer to the macro name
+    char *cmds = NULL;              // Pointer to the macro commands
+
+    if (name)
+    {
+        while (*name == ' ')
+            name++;
+        cmds = strchr(name, '=');
+    }
+    if (!cmds || cmds == name || memchr(name, ' ', cmds - name))
+    {
+        client.printf_P(PSTR("Invalid macro command\r\n\tUse: macro name=\"command;command...\""));
+        return;
+    }
+    *cmds++ = '\0';
+    if (*cmds == '"') // Strip the quotes that keep the ; separators out of the command line splitter
+    {
+        cmds++;
+        char *endq = strchr(cmds, '"');
+        if (endq)
+            *endq = '\0';
+    }
+
+    Node *enode = ts._findCommand(name);
+    Node *mnode = ts._matchCommand(name); // Commands with a match length also take any name starting with them
+    if (mnode && !mnode->commandMacro)    // Don't replace or hide built in or user commands
+    {
+        client.printf_P(PSTR("%s is already a command"), name);
+        return;
+    }
+    char *block = NULL; // Holds the name and commands, the commands also act as the help text
+    if (*cmds)
+    {
+        block = (char *)malloc(strlen(name) + strlen(cmds) + 2);
+        if (!block)
+        {
+            client.printf_P(PSTR("Out of memory"));
+            return;
+        }
+        strcpy(block, name);
+        strcpy(block + strlen(name) + 1, cmds);
+    }
+
+    char *oldBlock = enode && enode->dynamic ? (char *)enode->commandText : NULL;
+    if (block)
+    {
+        ts.addMacro(block, block + strlen(block) + 1, block + strlen(block) + 1);
+        ts._findCommand(block)->dynamic = true;
+        client.printf_P(PSTR("Macro %s defined"), block);
+    }
+    else if (enode) // No commands, remove the macro so the name is unknown again
+    {
+        ts._removeNode(enode);
+        client.printf_P(PSTR("Macro %s removed"), name);
+    }
+    else
+        client.printf_P(PSTR("No macro %s"), name);
+    if (oldBlock) // Replaced or removed, the node no longer points at it
+        free(oldBlock);
+}
+
 //////////////////////////////////////////////////////
 // Adds the standard menu items to the help command
 //////////////////////////////////////////////////////
@@ -709,5 +2071,9 @@ void SimpleTelnet::_addStdMenu(void)
     insertNode(PSTR("kill"), PSTR("Kill a session connection"), _killSession, 4);
     insertNode(PSTR("quit"), PSTR("End the connection"), _endSession);
     insertNode(PSTR("exit"), "", _endSession); // alias on quit command
+    insertNode(PSTR("upload"), PSTR("Raw upload, size=bytes [crc=hex]"), _startUpload, 6);
+    insertNode(PSTR("journal"), PSTR("Show log journal, tail [lines] | dump"), _journalCmd, 7);
+    insertNode(PSTR("subscribe"), PSTR("Choose log output, level=debug|info|warn|error topics=all|none|topic,topic..."), _subscribe, 9);
+    insertNode(PSTR("macro"), PSTR("Define a macro, name=\"command;command...\""), _defineMacro, 5);
     insertNode(PSTR("reboot"), PSTR("Reboot the system"), _telnetReboot);
 }
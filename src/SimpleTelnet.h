@@ -1,71 +1,266 @@
 #pragma once
 
+#include <atomic>
+#include <FS.h>
+
 #ifndef SIMPLETELNET
 #define SIMPLETELNET
 #endif
 
 #define SIMPLETELNETPORT 23   // Default port
-#define MAXCLIENTS 2          // Number of concurrent clients supported
+#define MAXCLIENTS 2          // Number of concurrent clients supported by telnetServer, other instances set their own (max 32)
 #define IDLETIMEOUT 3600000LL // Default timeout for inactive clients in milliseconds
 #define IDLEWARNING 300000LL  // Default timeout for inactive clients in milliseconds
-#define RXBUFFLEN 20          // Length of the command receive buffer, set this to the length of the longest command to be received
+#define IDLECHECKTIME 1000    // Milliseconds between checks for closed sessions and inactivity timeouts
+#define RXBUFFLEN 80          // Length of the command receive buffer, set this to the length of the longest command to be received
+#define RXBURST 64            // Maximum received characters parsed per client per action() call
+#define MACROLEN 128          // Maximum length of the commands run by a macro
+#define LOGLINELEN 128        // Maximum length of a single formatted log line
+#define BULKBUFFLEN 512       // Default size of the per client bulk output (log) queue
+#define BULKCHUNK 128         // Maximum bulk bytes sent to a client per action() call
+#define BULKRESERVE 256       // TCP tx space kept free for interactive output, bulk output waits above this
+#define BULKHOLDTIME 2000     // Milliseconds bulk output is held back while the user is part way through typing a command
+#define LOGQUEUELEN 16        // Number of records in the interrupt/thread safe log queue, must be a power of 2
+#define LOGRECLEN 64          // Maximum length of a log record posted through postLog()
+#define RAWCHUNKLEN 256       // Size of the chunks passed to the upload sink in raw receive mode
+#define RAWMAXCHUNKS 8        // Maximum number of raw chunks received per client per action() call
+#define RAWTIMEOUT 10000      // Milliseconds without data before a raw upload is abandoned
+#define JOURNALSEGMENTS 4     // Number of journal segment files kept, the oldest is deleted when a new one is started
+#define JOURNALSEGSIZE 16384  // Size a journal segment grows to before the journal moves on to a new segment
+#define JOURNALBUFFLEN 512    // Journal writes are batched in RAM until this fills or JOURNALFLUSHTIME passes
+#define JOURNALFLUSHTIME 5000 // Maximum milliseconds journal data is held in RAM before being written to flash
+#define JOURNALCHUNK 256      // Maximum journal bytes sent to a client per action() call by journal tail/dump
+#define HISTORYLEN 256        // Size of the command history pool shared by all the sessions of a server instance
+
+// Upload sink status codes
+#define UPLOAD_DATA 0   // data holds the next len bytes of the upload
+#define UPLOAD_DONE 1   // All bytes received and the crc, if given, matched
+#define UPLOAD_FAILED 2 // Upload abandoned, crc mismatch, timeout or session closed
+
+// Log levels
+#define LOGLEVEL_DEBUG 0           // Detail only wanted while debugging
+#define LOGLEVEL_INFO 1            // Normal output, used by broadcast() and postLog() when no level is given
+#define LOGLEVEL_WARN 2            // Something unexpected happened
+#define LOGLEVEL_ERROR 3           // Something failed
+#define LOGLEVELS 4                // Number of log levels
+#define LOGTOPIC_GENERAL 0         // Topic used by broadcast() and postLog() when no topic is given
+#define LOGTOPICS 32               // Number of log topic ids, each is a bit in a session's subscription mask
+#define JOURNALLEVEL LOGLEVEL_INFO // Lowest log level written to the journal
+
+#if MAXCLIENTS > 32
+#error "MAXCLIENTS can't be more than 32"
+#endif
 
 #ifndef __PROJECT
 #define __PROJECT "SimpleTelnet"
 #define __VERSION_SHORT "V2.2"
 #endif
 
+#ifndef TELNETNODEBUG // Define TELNETNODEBUG to build without the serial debug output, e.g. for timing
 #define TELNETDEBUG
+#endif
 
 extern WiFiClient telnetClients[];
+extern class TelnetClock telnetClock;
 class Node; // This defines an element on the liked list
 
+// State kept for each client session
+struct TelnetSession
+{
+    char rxbuff[RXBUFFLEN];   // Store received data
+    byte rxptr;               // Pointer to next free space in the rx buffer
+    time_t connectionTimer;   // Stores the millis() time when the last data was received from the client.  Used to timeout clients
+    time_t connectionTimeout; // Stores the millis() timeout time
+    bool timeoutWarning;      // Flag set to say we are about to timeout the session
+    byte rxcursor;            // Cursor position in the rx buffer
+    byte escState;            // Telnet command or terminal escape sequence being received
+    byte escParam;            // Number received in a terminal escape sequence
+    byte histBack;            // History entry being edited, counting back from the latest, 0 for a new line
+    bool authenticated;       // client is logged in sucessfully flag
+    bool idOK;                // id is ok flag
+    bool pwOK;                // pw is ok flag
+    char *bulkBuff;           // Bulk output ring buffer, only drained when the interactive lane is idle
+    uint16_t bulkHead;        // Next free space in the bulk ring buffer
+    uint16_t bulkTail;        // Next byte to send from the bulk ring buffer
+    uint16_t bulkSuppressed;  // Count of bulk lines dropped because the ring buffer was full
+    bool bulkPartial;         // Part of a bulk line has been sent, the prompt is redrawn when the line is finished
+    uint32_t rawRemaining;    // Raw upload bytes still to be received, 0 when the session is in line mode
+    uint32_t rawLength;       // Total size of the raw upload
+    uint32_t rawCrc;          // Running crc32 of the raw upload
+    uint32_t rawExpectedCrc;  // crc32 given with the upload command
+    bool rawCheckCrc;         // Set if a crc was given with the upload command
+    bool rawSkipEol;          // Discard the LF or NUL following the CR that ended the upload command
+    bool dumpActive;          // Set while the journal is being sent to the client
+    uint32_t dumpSeg;         // Journal segment being sent
+    uint32_t dumpPos;         // Position in the journal segment being sent
+    uint32_t dumpEndSeg;      // Journal segment where sending stops
+    uint32_t dumpEndPos;      // Position in the last segment where sending stops
+    fs::File dumpFile;        // Journal segment being sent, held open until it has all been sent
+    uint32_t subTopics;       // Bitmask of the log topics sent to this session
+    byte subLevel;            // Lowest log level sent to this session
+};
+
+// Formatted time strings, rebuilt at most once a second and shared by all server instances
+class TelnetClock
+{
+public:
+    TelnetClock(void);
+    const char *wallClock(void); // Returns the local time as "Www Mmm dd hh:mm:ss yyyy"
+    const char *stamp(void);     // Returns a log line prefix "hh:mm:ss.mmm ", only the milliseconds change within a second
+    const char *uptime(void);    // Returns the time since boot as "N Days, N Hours, N Minutes & N Seconds"
+    uint32_t uptimeSecs(void);   // Returns the seconds since boot
+
+private:
+    time_t _second;     // Wall clock second the strings were built for
+    char _clock[26];    // Cached wallClock() string
+    char _stamp[14];    // Cached stamp() string, the milliseconds are patched in on each call
+    uint16_t _millis;   // Milliseconds into the current second, set by _refresh()
+    uint32_t _upSecond; // Uptime second _uptime was built for
+    char _uptime[48];   // Cached uptime() string
+
+    void _refresh(void); // Rebuild the wall clock strings if the second has changed
+};
+
+// A pre-formatted log record in the multi-producer log queue
+struct LogRecord
+{
+    std::atomic<uint32_t> seq; // Sequence number, says whether the record is free or holds data to be sent
+    char text[LOGRECLEN];      // The log text
+    byte level;                // Log level of the record
+    byte topic;                // Log topic of the record
+};
+
 class SimpleTelnet
 {
 public:
     SimpleTelnet(void);
+    SimpleTelnet(byte maxClients, WiFiClient *clients = NULL, uint16_t bulkLen = BULKBUFFLEN);                     // An instance with its own slots, clients is allocated if NULL
     void begin(void);                                                                                              // Initialiser, called by setup(), uses default port 23
     void begin(uint16 port);                                                                                       // Initialiser, called by setup(), user defined port
     void action(void);                                                                                             // Service routine, called by loop()
     void insertNode(const char *text, const char *helptext, void (*action)(byte cID, char *cbuff));                // Function to insert a new node, exact match
     void insertNode(const char *text, const char *helptext, void (*action)(byte cID, char *cbuff), byte matchlen); // Function to insert a new node, matchlen is the length of cammand required to match for a hit
+    void addMacro(const char *name, const char *helptext, const char *commands);                                   // Add a named macro that runs the ; separated commands
     void printList(byte clientID);                                                                                 // Display the menu command list
     void setTimeout(byte clientID, uint16_t tmins);                                                                // Set the inactivity timeout to tmins minutes
     uint16_t getTimeout(byte clientID);                                                                            // Returns the inactivity timeout remaining in minutes
     void setUserId(const char *id);                                                                                // Set a user id
     void setUserPw(const char *pw);                                                                                // Set a user Pw
+    void broadcast(const char *format, ...);                                                                       // Queue a log line to all clients on the bulk output lane, format is PROGMEM aware
+    void broadcast(byte level, byte topic, const char *format, ...);                                               // As above, only sent to sessions subscribed to topic at level, nothing is formatted if there are none
+    bool postLog(const char *text);                                                                                // Queue a pre-formatted log line from any context (ISR, timer, thread), never blocks
+    bool postLog(byte level, byte topic, const char *text);                                                        // As above, the line is discarded straight away if no session is subscribed to topic at level
+    void addTopic(byte topic, const char *name);                                                                   // Name a log topic for the subscribe command
+    uint32_t getLogDrops(void);                                                                                    // Returns the number of postLog() records dropped because the queue was full
+    void setUploadSink(void (*sink)(byte cID, const uint8_t *data, uint16_t len, byte status));                    // Register the function that receives raw uploads
+    bool beginJournal(fs::FS &fs);                                                                                 // Start recording log output to a journal on the mounted filesystem fs
+    void flushJournal(void);                                                                                       // Write any batched journal data to flash now
+    void setLogStamps(bool enable);                                                                                // Prefix broadcast() and postLog() lines with a "hh:mm:ss.mmm " time stamp
+    WiFiClient &client(byte clientID);                                                                             // Returns the client connection in slot clientID
+    byte maxClients(void);                                                                                         // Returns the number of client slots
+    static SimpleTelnet &current(void);                                                                            // Returns the instance running the current command, for use in menu callbacks
 
 private:
-    Node *head;                            // pointer to first element of the linked list
-    time_t _bootTime;                      // Set to the rtc time when we booted. Note, depends on NTP working
-    char _rxbuff[MAXCLIENTS][RXBUFFLEN];   // Store received data
-    char _lastbuff[MAXCLIENTS][RXBUFFLEN]; // Store previous received data
-    time_t _connectionTimer[MAXCLIENTS];   // Stores the millis() time when the last data was received from the client.  Used to timeout clients
-    time_t _connectionTimeout[MAXCLIENTS]; // Stores the millis() timeout time
-    bool _timeoutWarning[MAXCLIENTS];      // Flag set to say we are about to timeout the session
-    byte _uparrowState[MAXCLIENTS];        // state pointer for up arrow processing
-    const char *_loginid;                  // Points to a userid or null if none set/required
-    const char *_loginpw;                  // Points to a password or null if none set/required
-    time_t _timeNow;                       // Buffer to hold the current time as secondssince 1/1/1970
-    bool _authenticated[MAXCLIENTS];       // client is logged in sucessfully flag
-    bool _idOK[MAXCLIENTS];                // id is ok flag
-    bool _pwOK[MAXCLIENTS];                // pw is ok flag
-
-    time_t _uptime(void); // Returns the time_t elapsed since boot
-    time_t now(void);     // Returns the current time'
+    Node *head;                    // pointer to first element of the linked list
+    time_t _bootTime;              // Set to the rtc time when we booted. Note, depends on NTP working
+    const char *_loginid;          // Points to a userid or null if none set/required
+    const char *_loginpw;          // Points to a password or null if none set/required
+    WiFiServer *_server;           // Telnet server, listens for new connections
+    WiFiClient *_clients;          // The connected clients, one per slot
+    TelnetSession *_sessions;      // Session state, one per slot
+    byte _maxClients;              // Number of client slots
+    uint16_t _bulkLen;             // Size of each session's bulk output ring buffer
+    uint32_t _activeClients;       // Bitmask of slots holding a session, only these are serviced by action()
+    unsigned long _lastTick;       // millis() time of the last housekeeping check
+    bool _logStamps;               // Prefix log lines with a time stamp
+    static SimpleTelnet *_current; // Instance running the current command
+
+    LogRecord _logQueue[LOGQUEUELEN];     // Multi-producer single consumer log queue, filled by postLog() drained by action()
+    std::atomic<uint32_t> _logEnqueuePos; // Next record position to be claimed by a producer
+    uint32_t _logDequeuePos;              // Next record position to be sent, only used by action()
+    std::atomic<uint32_t> _logDrops;      // Count of records dropped because the queue was full
+
+    uint32_t _subscribed[LOGLEVELS];    // Topics wanted by a session or the journal at each level, checked before a log line is formatted
+    const char *_topicNames[LOGTOPICS]; // Topic names for the subscribe command, NULL if not named
+
+    uint8_t *_history;  // Command history pool, entries from all sessions are held as text, clientID, length
+    uint16_t _histHead; // Next free byte in the history pool
+    uint16_t _histUsed; // Bytes of the history pool holding entries
+
+    void (*_uploadSink)(byte cID, const uint8_t *data, uint16_t len, byte status); // Receives raw upload data, NULL if uploads are not supported
+
+    fs::FS *_journalFS;          // Filesystem holding the journal, NULL if the journal is not in use
+    fs::File _journalFile;       // Current journal segment, open for append
+    uint32_t _journalFirst;      // Sequence number of the oldest journal segment
+    uint32_t _journalSeq;        // Sequence number of the journal segment being written
+    char *_journalBuff;          // Batches journal writes to reduce flash wear, allocated by beginJournal()
+    uint16_t _journalLen;        // Bytes waiting in _journalBuff
+    unsigned long _journalTimer; // millis() time of the last journal flush
+
     void _addStdMenu(void);
     void _parseChar(char rxval, byte clientID);
-    bool _ProcessList(char *command, byte cID);   // Function to process the linked list. command parameter is the command to be processed
-    Node *_findCommand(const char *command);      // Search the node list to see if a command alreay exists
-    void _resetParser(byte clientID);             // Clears the parser vars ready for a new client connection
-    bool _checkid(byte clientID, char *rxbuff);   // Check id/pw for client login
-    int _strcmp_PP(const char *a, const char *b); // PROGMEM compare two strings in flash
+    bool _runCommands(char *line, byte cID, byte depth, byte parent);    // Run a command line, which may hold several ; separated commands
+    char *_nextCommand(char *line);                                      // Find the ; ending the first command in a command line
+    bool _ProcessList(char *command, byte cID, byte depth, byte parent); // Function to process the linked list. command parameter is the command to be processed
+    Node *_matchCommand(const char *command);                            // Find the node matching the command entered
+    Node *_findCommand(const char *command);                             // Search the node list to see if a command alreay exists
+    void _removeNode(Node *node);                                        // Unlink a node from the list and delete it
+    void _resetParser(byte clientID);                                    // Clears the parser vars ready for a new client connection
+    bool _checkid(byte clientID, char *rxbuff);                          // Check id/pw for client login
+    int _strcmp_PP(const char *a, const char *b);                        // PROGMEM compare two strings in flash
+
+    void _queueBulk(byte clientID, const char *text, uint16_t len); // Add a line to the clients bulk output lane
+    void _drainBulk(byte clientID);                                 // Send queued bulk output if the interactive lane is idle
+    void _drainLog(void);                                           // Move records posted by postLog() to the bulk output lanes
+    void _receiveRaw(byte clientID);                                // Stream raw upload data to the upload sink, bypassing the line parser
+    void _endUpload(byte clientID, byte status);                    // Return the session to line mode and tell the sink how the upload ended
+    void _journalLine(const char *line, uint16_t len);              // Add a log line to the journal
+    char *_journalPath(char *buff, uint32_t seq);                   // Build the file name of journal segment seq
+    void _startDump(byte clientID, uint32_t lines);                 // Start sending the journal to a client, lines = 0 for all of it
+    void _sendJournal(byte clientID);                               // Send the next block of the journal to a client
+
+    void _broadcastLine(const char *line, uint16_t len, byte level, byte topic); // Queue a formatted line to the bulk output lanes of the clients subscribed to it
+    void _vbroadcast(byte level, byte topic, const char *format, va_list args);  // Format and queue a log line if anyone is subscribed to it
+    void _updateSubscriptions(void);                                             // Rebuild _subscribed[] from the session subscriptions
+    byte _findTopic(const char *name);                                           // Returns the topic id for a name or number, LOGTOPICS if not found
+
+    char *_editCursor(TelnetSession &session, byte to, char *out);           // Move the cursor to to, adding the fewest bytes that do it to out
+    char *_editReplace(TelnetSession &session, const char *text, char *out); // Replace the line being edited with text, only redrawing what changed
+    char *_editRedraw(TelnetSession &session, char *out);                    // Redraw the prompt and the line being edited after other output
+    void _historyAdd(byte clientID, const char *line);                       // Add a command line to the history pool
+    bool _historyGet(byte clientID, byte back, char *buff);                  // Copy the back'th latest history entry of the client to buff
+    void _historyForget(byte clientID);                                      // Drop the client's history entries, called when a new session takes the slot
 
     friend void _telnetInfo(byte clientID, char *buff);
     friend void _showHelpMessage(byte clientID, char *buff);
+    friend void _telnetReboot(byte clientID, char *buff);
+    friend void _startUpload(byte clientID, char *buff);
+    friend void _journalCmd(byte clientID, char *buff);
+    friend void _defineMacro(byte clientID, char *buff);
+    friend void _subscribe(byte clientID, char *buff);
+    friend class SimpleTelnetTest; // The unit tests in test/ drive the parser directly
 };
 extern SimpleTelnet telnetServer; // the telnet server class
 
+// Telnet commands
+#define TELNET_SE 240   // End of subnegotiation
+#define TELNET_SB 250   // Start of subnegotiation
+#define TELNET_WILL 251 // Sender wants to enable an option
+#define TELNET_IAC 255  // Interpret as command, starts every telnet command
+#define TELNET_ECHO 1   // Echo option, the server echoes the input when enabled
+#define TELNET_SGA 3    // Suppress go ahead option, puts the client in character at a time mode
+
+// Line editor input states
+#define EDIT_NONE 0   // Normal input
+#define EDIT_ESC 1    // Esc received
+#define EDIT_CSI 2    // Esc [ received, collecting the escape sequence number
+#define EDIT_SS3 3    // Esc O received
+#define EDIT_IAC 4    // Telnet IAC received
+#define EDIT_OPTION 5 // Telnet option negotiation, waiting for the option
+#define EDIT_SB 6     // Telnet subnegotiation, discarded until IAC SE
+#define EDIT_SBIAC 7  // IAC received during a subnegotiation
+#define EDIT_CR 8     // CR received, a following LF or NUL is discarded
+
 // ANSI COLOURs
 #define COLOUR_RESET "\x1B[0m"
 #define COLOUR_BLACK "\x1B[0;30m"
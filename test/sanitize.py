@@ -0,0 +1,4 @@
+# The sanitizer runtimes and threads have to be linked as well as compiled in, build_flags only reach the compiler
+Import("env")
+
+env.Append(LINKFLAGS=["-pthread", "-fsanitize=address,undefined"])
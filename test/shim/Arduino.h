@@ -0,0 +1,151 @@
+// Minimal Arduino core shim so the library builds and runs on the host for the native test environment.
+// Only what SimpleTelnet uses is provided, PROGMEM is ordinary RAM and output written to a Print goes nowhere.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <string>
+#include <chrono>
+
+typedef uint8_t byte;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+
+//////////////////////////////////////////////////////
+// PROGMEM support
+//////////////////////////////////////////////////////
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define FPSTR(s) (s)
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define strncmp_P strncmp
+#define strcmp_P strcmp
+#define strlen_P strlen
+#define sprintf_P sprintf
+#define snprintf_P snprintf
+#define vsnprintf_P vsnprintf
+#define memcpy_P memcpy
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define IRAM_ATTR
+#define ICACHE_RAM_ATTR
+
+//////////////////////////////////////////////////////
+// Timing
+//////////////////////////////////////////////////////
+inline const std::chrono::steady_clock::time_point _shimStart = std::chrono::steady_clock::now();
+
+inline uint64_t micros64(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _shimStart).count();
+}
+inline unsigned long micros(void)
+{
+    return (unsigned long)micros64();
+}
+inline unsigned long millis(void)
+{
+    return (unsigned long)(micros64() / 1000);
+}
+inline void delay(unsigned long) {}
+inline void yield(void) {}
+
+//////////////////////////////////////////////////////
+// Print, Stream and friends
+//////////////////////////////////////////////////////
+class Print;
+
+class String
+{
+public:
+    const char *c_str() const { return ""; }
+};
+
+class IPAddress
+{
+public:
+    uint8_t operator[](int) const { return 0; }
+    size_t printTo(Print &) const { return 0; }
+};
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) { return write(&c, 1); }
+    virtual size_t write(const uint8_t *buffer, size_t size) { return size; }
+    size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+    size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+    size_t print(const char *str) { return write(str); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int n) { return printf("%d", n); }
+    size_t print(unsigned n) { return printf("%u", n); }
+    size_t print(unsigned long n) { return printf("%lu", n); }
+    size_t print(const String &s) { return write(s.c_str()); }
+    size_t println(void) { return write("\r\n"); }
+    size_t println(const char *str) { return print(str) + println(); }
+    size_t println(char c) { return print(c) + println(); }
+    size_t println(unsigned long n) { return print(n) + println(); }
+    size_t println(const IPAddress &) { return println(); }
+    size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char buff[1024];
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(buff, sizeof(buff), format, args);
+        va_end(args);
+        return len > 0 ? write((const uint8_t *)buff, len < (int)sizeof(buff) ? len : sizeof(buff) - 1) : 0;
+    }
+    size_t printf_P(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        char buff[1024];
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(buff, sizeof(buff), format, args);
+        va_end(args);
+        return len > 0 ? write((const uint8_t *)buff, len < (int)sizeof(buff) ? len : sizeof(buff) - 1) : 0;
+    }
+    virtual int availableForWrite(void) { return 0; }
+    virtual void flush(void) {}
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available(void) { return 0; }
+    virtual int read(void) { return -1; }
+    virtual int peek(void) { return -1; }
+};
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long) {}
+};
+inline HardwareSerial Serial;
+
+//////////////////////////////////////////////////////
+// ESP system information, all zero on the host
+//////////////////////////////////////////////////////
+class EspClass
+{
+public:
+    uint32_t getChipId(void) { return 0; }
+    uint32_t getFlashChipId(void) { return 0; }
+    uint32_t getFlashChipRealSize(void) { return 0; }
+    String getResetReason(void) { return String(); }
+    uint32_t getFreeContStack(void) { return 0; }
+    uint32_t getFreeHeap(void) { return 0; }
+    uint32_t getMaxFreeBlockSize(void) { return 0; }
+    uint8_t getHeapFragmentation(void) { return 0; }
+    uint32_t getFreeSketchSpace(void) { return 0; }
+    uint16_t getVcc(void) { return 0; }
+    void restart(void) {}
+};
+inline EspClass ESP;
@@ -0,0 +1,75 @@
+// Host shim for the ESP8266 WiFi classes used by SimpleTelnet.  A WiFiClient is a pair of byte queues, tests put
+// received data in rx and read what the server sent from tx.  Like the real class nothing is written when unconnected.
+#pragma once
+#include <Arduino.h>
+
+class WiFiClient : public Stream
+{
+public:
+    bool conn = false;  // Set by a test to make the client look connected
+    std::string rx;     // Bytes waiting to be read by the server
+    std::string tx;     // Bytes written by the server
+    int txRoom = 65535; // Value returned by availableForWrite()
+
+    uint8_t connected(void) { return conn; }
+    operator bool(void) { return conn; }
+    int available(void) override { return rx.size(); }
+    int read(void) override
+    {
+        if (rx.empty())
+            return -1;
+        int c = (uint8_t)rx[0];
+        rx.erase(0, 1);
+        return c;
+    }
+    int read(uint8_t *buffer, size_t size)
+    {
+        if (size > rx.size())
+            size = rx.size();
+        memcpy(buffer, rx.data(), size);
+        rx.erase(0, size);
+        return size;
+    }
+    int peek(void) override { return rx.empty() ? -1 : (uint8_t)rx[0]; }
+    using Print::write;
+    size_t write(const uint8_t *buffer, size_t size) override
+    {
+        if (!conn)
+            return 0;
+        tx.append((const char *)buffer, size);
+        return size;
+    }
+    int availableForWrite(void) override { return conn ? txRoom : 0; }
+    void setNoDelay(bool) {}
+    IPAddress remoteIP(void) { return IPAddress(); }
+    uint16_t remotePort(void) { return 0; }
+    void stop(void) { conn = false; }
+};
+
+class WiFiServer
+{
+public:
+    WiFiServer(uint16_t) {}
+    void begin(void) {}
+    void begin(uint16_t) {}
+    void stop(void) {}
+    void setNoDelay(bool) {}
+    bool hasClient(void) { return false; }
+    WiFiClient accept(void) { return WiFiClient(); }
+    WiFiClient available(void) { return WiFiClient(); }
+};
+
+class WiFiClass
+{
+public:
+    String hostname(void) { return String(); }
+    IPAddress localIP(void) { return IPAddress(); }
+    IPAddress subnetMask(void) { return IPAddress(); }
+    IPAddress gatewayIP(void) { return IPAddress(); }
+    IPAddress dnsIP(int = 0) { return IPAddress(); }
+    String macAddress(void) { return String(); }
+    String SSID(void) { return String(); }
+    int32_t RSSI(void) { return 0; }
+    void printDiag(Print &) {}
+};
+inline WiFiClass WiFi;
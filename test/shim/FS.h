@@ -0,0 +1,41 @@
+// Host shim for the ESP8266 filesystem classes, there are no files so the journal can't be opened.
+#pragma once
+#include <Arduino.h>
+
+namespace fs
+{
+enum SeekMode
+{
+    SeekSet = 0,
+    SeekCur = 1,
+    SeekEnd = 2
+};
+
+class File : public Stream
+{
+public:
+    operator bool(void) const { return false; }
+    size_t size(void) const { return 0; }
+    bool seek(uint32_t, SeekMode = SeekSet) { return false; }
+    using Stream::read;
+    size_t read(uint8_t *, size_t) { return 0; }
+    using Print::write;
+    size_t write(const uint8_t *, size_t size) override { return size; }
+    void close(void) {}
+};
+
+class Dir
+{
+public:
+    bool next(void) { return false; }
+    String fileName(void) { return String(); }
+};
+
+class FS
+{
+public:
+    File open(const char *, const char *) { return File(); }
+    Dir openDir(const char *) { return Dir(); }
+    bool remove(const char *) { return false; }
+};
+} // namespace fs
@@ -0,0 +1,4 @@
+// Host shim for the Time library header, the C library time functions are all SimpleTelnet needs.  include_next
+// keeps this working where the filesystem is case insensitive and time.h finds this file first.
+#pragma once
+#include_next <time.h>
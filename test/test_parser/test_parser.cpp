@@ -0,0 +1,250 @@
+//////////////////////////////////////////////////////
+// Input path tests and benchmarks
+//////////////////////////////////////////////////////
+//
+// pio test -e native runs these on the host against the shim in test/shim, built with ASan and UBSan so the bounds
+// check traps an index past the end of rxbuff as the byte is written, not after.  pio test -e nodemcuv2_test runs the
+// same tests on the board, built without TELNETDEBUG, where the parser and dispatch times are the real ones.  The
+// parser is fed with and without a login id and password set, so the login checks are covered as well as line
+// editing.  Input goes through a slot of a private instance whose client is only connected when a test wants to see
+// the output, with the command list emptied so nothing fed in can run.
+//
+//////////////////////////////////////////////////////
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <SimpleTelnet.h>
+#include <unity.h>
+
+#ifdef ARDUINO
+#define FUZZRUNS 2000 // Number of mutated inputs fed to the parser, kept short on the board
+#else
+#define FUZZRUNS 200000
+#endif
+#define BENCHLOOPS 200     // Number of sample lines fed to the parser by the parser benchmark
+#define BENCHLOOKUPS 20000 // Number of commands looked up by the dispatch benchmark, divided by the command list size
+#define BENCHMAXCMDS 1000  // Largest command list timed by the dispatch benchmark
+#define TESTPORT 2323      // Port of the test instance, kept off the default telnet port
+#define TESTID "admin"     // Login id used by the login tests
+#define TESTPW "secret"    // Password used by the login tests
+
+WiFiClient testClients[1];
+SimpleTelnet testTelnet(1, testClients);
+
+// Reaches the parser state behind the public API, SimpleTelnet declares it a friend
+class SimpleTelnetTest
+{
+public:
+    static TelnetSession &session(byte slot) { return testTelnet._sessions[slot]; }
+    static void parseChar(char c, byte slot) { testTelnet._parseChar(c, slot); }
+    static void resetParser(byte slot) { testTelnet._resetParser(slot); }
+    static void clearCommands(void)
+    {
+        while (testTelnet.head)
+            testTelnet._removeNode(testTelnet.head);
+    }
+    static bool matchCommand(const char *command) { return testTelnet._matchCommand(command) != NULL; }
+};
+
+void setUp(void)
+{
+    SimpleTelnetTest::clearCommands(); // Nothing can run
+    SimpleTelnetTest::resetParser(0);
+}
+
+void tearDown(void)
+{
+    testTelnet.setUserId(NULL); // Back to no login for the next test
+    testTelnet.setUserPw(NULL);
+    testClients[0].conn = false;
+    testClients[0].tx.clear();
+}
+
+// Feed the parser through slot 0 and check its state is sane after every byte, the seeds are mutated one byte in eight
+static void fuzzParser(const char *const *seeds, byte seedCount)
+{
+    TelnetSession &session = SimpleTelnetTest::session(0);
+    uint32_t rng = 0x2545F491; // xorshift32 state, fixed so a failure can be repeated
+    char message[80];
+
+    for (uint32_t n = 0; n < FUZZRUNS; n++)
+    {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        const char *seed = seeds[rng % seedCount];
+        byte repeat = 1 + (rng >> 8) % 4; // Repeat the seed to fill the buffer
+        for (auto r = 0; r < repeat; r++)
+        {
+            for (const char *p = seed; *p; p++)
+            {
+                rng ^= rng << 13;
+                rng ^= rng >> 17;
+                rng ^= rng << 5;
+                char c = (rng & 0x07) ? *p : (char)(rng >> 24); // Mutate one byte in eight
+                SimpleTelnetTest::parseChar(c, 0);
+                if (session.rxptr >= RXBUFFLEN || session.rxbuff[session.rxptr] || session.rxcursor > session.rxptr ||
+                    session.escState > EDIT_CR)
+                {
+                    snprintf(message, sizeof(message), "Run %u byte 0x%02X, rxptr %u rxcursor %u", n, (byte)c, session.rxptr, session.rxcursor);
+                    TEST_FAIL_MESSAGE(message);
+                }
+            }
+        }
+        if (!(n & 0x3F))
+            yield();
+    }
+}
+
+// Time the parser over sample, starting each pass logged out so any login is checked every time
+static void benchParser(const char *name, const char *sample, uint16_t sampleLen)
+{
+    TelnetSession &session = SimpleTelnetTest::session(0);
+    uint32_t bytes = 0;
+    char message[80];
+
+    unsigned long start = micros();
+    for (auto n = 0; n < BENCHLOOPS; n++)
+    {
+        for (uint16_t k = 0; k < sampleLen; k++)
+            SimpleTelnetTest::parseChar(sample[k], 0);
+        bytes += sampleLen;
+        session.rxptr = 0; // Start a new line without submitting this one
+        session.rxcursor = 0;
+        session.rxbuff[0] = '\0';
+        session.idOK = false;
+        session.pwOK = false;
+        if (!(n & 0x3F))
+            yield();
+    }
+    unsigned long elapsed = micros() - start;
+    snprintf(message, sizeof(message), "%s %u ns/byte (%u bytes)", name, (uint32_t)((uint64_t)elapsed * 1000 / bytes), bytes);
+    TEST_MESSAGE(message);
+}
+
+// Feed the parser mutated seed inputs and check its state after every byte
+void test_parser_fuzz(void)
+{
+    static const char *const seeds[] = {
+        "help\r", "set timeout=5\r\n", "\x1B[A", "\x1B[A\x1B[A\x08\x08\x08", "\x08\x08\x08\x08>", "\x1B\x1B[\x1B[A\x1B[B",
+        "\xFF\xFF\t\n\r", "info;sessions;bogus\r", "macro m=\"a;b\"\r", "0123456789012345678901234567890123456789",
+        "ab\x1B[D\x1B[Dx\x1B[3~\x1B[H\x1B[F\x7F", "\xFF\xFA\x18xterm\xFF\xF0\xFF\xFD\x01", "\x1BOA\x1B[12;5C\x01\x05\x02\x06\x04"};
+
+    fuzzParser(seeds, sizeof(seeds) / sizeof(seeds[0]));
+}
+
+// As above with a login id and password set, so the login checks and password hiding are exercised too
+void test_login_fuzz(void)
+{
+    static const char *const seeds[] = {
+        TESTID "\r", TESTPW "\r", TESTID "\r" TESTPW "\r", "adm\r", "administrator\r", "secretive\r", "\r", "\x1B[A\r",
+        "wrong id\r\n", "0123456789012345678901234567890123456789\r", "se\x08\x08secret\r", "\xFF\xFB\x01\xFF\xFD\x03"};
+
+    testTelnet.setUserId(TESTID);
+    testTelnet.setUserPw(TESTPW);
+    SimpleTelnetTest::resetParser(0);
+    fuzzParser(seeds, sizeof(seeds) / sizeof(seeds[0]));
+}
+
+// The password must never be echoed, though the end of the line is
+void test_login_hidden(void)
+{
+    testTelnet.setUserId(TESTID);
+    testTelnet.setUserPw(TESTPW);
+    testClients[0].conn = true;
+    SimpleTelnetTest::resetParser(0);
+    for (const char *p = TESTID "\r"; *p; p++)
+        SimpleTelnetTest::parseChar(*p, 0);
+    TEST_ASSERT_TRUE(testClients[0].tx.find(TESTID) != std::string::npos); // The id is echoed
+    testClients[0].tx.clear();
+    for (const char *p = TESTPW "\r"; *p; p++)
+        SimpleTelnetTest::parseChar(*p, 0);
+    TEST_ASSERT_TRUE(testClients[0].tx.find(TESTPW) == std::string::npos);
+    TEST_ASSERT_TRUE(SimpleTelnetTest::session(0).pwOK);
+}
+
+// Time the parser with a typical mix of command text, escape sequences and backspaces
+void test_parser_bench(void)
+{
+    const char sample[] = "set timeout=10 \x1B[B kill session=2\x08\x08\x1B[D\x1B[D3\x1B[F";
+
+#ifdef TELNETDEBUG
+    TEST_MESSAGE("TELNETDEBUG is defined, parser times include serial debug output");
+#endif
+    benchParser("Parser", sample, sizeof(sample) - 1);
+}
+
+// Time logging in, with wrong and over long ids and passwords before the right ones
+void test_login_bench(void)
+{
+    const char sample[] = "administrator\r" TESTID "\r" "wrong password\r" TESTPW "\r";
+
+    testTelnet.setUserId(TESTID);
+    testTelnet.setUserPw(TESTPW);
+    benchParser("Login", sample, sizeof(sample) - 1);
+}
+
+// Time command lookups against lists of 10, 100 and 1000 commands, for the last command in the list and a miss
+void test_dispatch_bench(void)
+{
+    static const uint16_t sizes[] = {10, 100, BENCHMAXCMDS};
+    static char names[BENCHMAXCMDS][6]; // Command names c0000, c0001...
+    char message[96];
+
+    for (auto k = 0; k < BENCHMAXCMDS; k++)
+        snprintf(names[k], sizeof(names[k]), "c%04u", k);
+    for (auto s = 0; s < 3; s++)
+    {
+        uint16_t size = sizes[s];
+        SimpleTelnetTest::clearCommands();
+        for (auto k = 0; k < size; k++)
+            testTelnet.insertNode(names[k], "", NULL);
+
+        uint32_t loops = BENCHLOOKUPS / size;
+        uint32_t hits = 0;
+        unsigned long start = micros();
+        for (uint32_t n = 0; n < loops; n++)
+            hits += SimpleTelnetTest::matchCommand(names[size - 1]);
+        unsigned long timeHit = micros() - start;
+        yield();
+        start = micros();
+        for (uint32_t n = 0; n < loops; n++)
+            hits += SimpleTelnetTest::matchCommand("zzzzz");
+        unsigned long timeMiss = micros() - start;
+        TEST_ASSERT_EQUAL_UINT32(loops, hits); // Every lookup of the last command matched and no miss did
+
+        snprintf(message, sizeof(message), "Dispatch %4u commands: %u ns/lookup (last), %u ns/lookup (miss)", size,
+                 (uint32_t)((uint64_t)timeHit * 1000 / loops), (uint32_t)((uint64_t)timeMiss * 1000 / loops));
+        TEST_MESSAGE(message);
+        yield();
+    }
+}
+
+int runTests(void)
+{
+    testTelnet.begin(TESTPORT);
+    UNITY_BEGIN();
+    RUN_TEST(test_parser_fuzz);
+    RUN_TEST(test_login_fuzz);
+    RUN_TEST(test_login_hidden);
+    RUN_TEST(test_parser_bench);
+    RUN_TEST(test_login_bench);
+    RUN_TEST(test_dispatch_bench);
+    return UNITY_END();
+}
+
+#ifdef ARDUINO
+void setup()
+{
+    delay(2000); // Give the test runner time to open the serial port
+    runTests();
+}
+
+void loop()
+{
+}
+#else
+int main(void)
+{
+    return runTests();
+}
+#endif
@@ -0,0 +1,158 @@
+//////////////////////////////////////////////////////
+// postLog() multi-producer tests and benchmark
+//////////////////////////////////////////////////////
+//
+// Host only, pio test -e native.  POSTTHREADS producer threads each post POSTCALLS numbered lines while one consumer
+// thread calls _drainLog(), as action() would, and takes the lines off the bulk lane of a session that is subscribed
+// to everything.  Every call must be either queued or counted as dropped, every line received must be intact and each
+// producer's lines must arrive in the order they were posted.  Build with -fsanitize=thread in place of the address
+// sanitizer to check the claim and publish steps for data races.
+//
+//////////////////////////////////////////////////////
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <SimpleTelnet.h>
+#include <unity.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define POSTTHREADS 4    // Number of producer threads
+#define POSTCALLS 100000 // postLog() calls made by each producer
+#define POSTBULKLEN 4096 // Bulk lane size, big enough to hold a full drain of the log queue
+#define TESTPORT 2323    // Port of the test instance, kept off the default telnet port
+
+WiFiClient testClients[1];
+SimpleTelnet testTelnet(1, testClients, POSTBULKLEN);
+
+// Reaches the log queue consumer behind the public API, SimpleTelnet declares it a friend
+class SimpleTelnetTest
+{
+public:
+    static void subscribe(void) // Make slot 0 a session that wants every log line
+    {
+        testTelnet._resetParser(0);
+        testTelnet._sessions[0].subLevel = LOGLEVEL_DEBUG;
+        testTelnet._activeClients = 1;
+        testTelnet._updateSubscriptions();
+    }
+    static void drainLog(void) { testTelnet._drainLog(); }
+    static void takeBulk(std::string &out) // Move whatever is on slot 0's bulk lane to out
+    {
+        TelnetSession &session = testTelnet._sessions[0];
+        while (session.bulkTail != session.bulkHead)
+        {
+            out += session.bulkBuff[session.bulkTail];
+            session.bulkTail = (session.bulkTail + 1) % POSTBULKLEN;
+        }
+    }
+    static uint16_t bulkSuppressed(void) { return testTelnet._sessions[0].bulkSuppressed; }
+};
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+void test_postlog_threads(void)
+{
+    std::thread producers[POSTTHREADS];
+    uint32_t queued[POSTTHREADS] = {};  // Calls that returned true, per producer
+    uint32_t dropped[POSTTHREADS] = {}; // Calls that returned false, per producer
+    uint64_t elapsed[POSTTHREADS] = {}; // Nanoseconds spent inside postLog(), per producer
+    std::atomic<int> running(POSTTHREADS);
+    uint32_t received[POSTTHREADS] = {}; // Lines taken off the bulk lane, per producer
+    uint32_t nextSeq[POSTTHREADS] = {};  // Lowest sequence number the next line from each producer may have
+    uint32_t corrupt = 0;
+    uint32_t outOfOrder = 0;
+    std::string pending;
+    char message[96];
+
+    SimpleTelnetTest::subscribe();
+    uint32_t dropsBefore = testTelnet.getLogDrops();
+    for (auto t = 0; t < POSTTHREADS; t++)
+    {
+        producers[t] = std::thread([&, t]() {
+            char line[LOGRECLEN];
+            for (uint32_t n = 0; n < POSTCALLS; n++)
+            {
+                snprintf(line, sizeof(line), "P%d %u\r\n", t, n);
+                auto start = std::chrono::steady_clock::now();
+                bool ok = testTelnet.postLog(LOGLEVEL_INFO, LOGTOPIC_GENERAL, line);
+                elapsed[t] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                if (ok)
+                    queued[t]++;
+                else
+                {
+                    dropped[t]++;
+                    std::this_thread::yield(); // Give the consumer a chance so plenty of lines get through as well
+                }
+            }
+            running--;
+        });
+    }
+
+    bool more = true;
+    while (more) // Consume until the producers have finished and the queue is empty
+    {
+        more = running > 0;
+        SimpleTelnetTest::drainLog();
+        SimpleTelnetTest::takeBulk(pending);
+        size_t eol;
+        while ((eol = pending.find("\r\n")) != std::string::npos)
+        {
+            int t;
+            unsigned seq;
+            char tail;
+            std::string line = pending.substr(0, eol);
+            pending.erase(0, eol + 2);
+            if (sscanf(line.c_str(), "P%d %u%c", &t, &seq, &tail) != 2 || t < 0 || t >= POSTTHREADS || seq >= POSTCALLS)
+            {
+                corrupt++;
+                continue;
+            }
+            if (seq < nextSeq[t])
+                outOfOrder++;
+            nextSeq[t] = seq + 1;
+            received[t]++;
+        }
+    }
+    for (auto t = 0; t < POSTTHREADS; t++)
+        producers[t].join();
+
+    uint32_t totalQueued = 0;
+    uint32_t totalDropped = 0;
+    uint32_t totalReceived = 0;
+    uint64_t totalElapsed = 0;
+    for (auto t = 0; t < POSTTHREADS; t++)
+    {
+        TEST_ASSERT_EQUAL_UINT32(POSTCALLS, queued[t] + dropped[t]);
+        TEST_ASSERT_EQUAL_UINT32(queued[t], received[t]); // Every queued line of this producer was received
+        totalQueued += queued[t];
+        totalDropped += dropped[t];
+        totalReceived += received[t];
+        totalElapsed += elapsed[t];
+    }
+    TEST_ASSERT_EQUAL_UINT32(POSTTHREADS * POSTCALLS, totalQueued + totalDropped);
+    TEST_ASSERT_EQUAL_UINT32(totalQueued, totalReceived);
+    TEST_ASSERT_EQUAL_UINT32(totalDropped, testTelnet.getLogDrops() - dropsBefore);
+    TEST_ASSERT_EQUAL_UINT32(0, corrupt);
+    TEST_ASSERT_EQUAL_UINT32(0, outOfOrder);
+    TEST_ASSERT_EQUAL_UINT32(0, SimpleTelnetTest::bulkSuppressed());
+    TEST_ASSERT_TRUE(pending.empty());
+
+    snprintf(message, sizeof(message), "%d threads: %u queued, %u dropped, %u ns/postLog", POSTTHREADS, totalQueued,
+             totalDropped, (uint32_t)(totalElapsed / ((uint64_t)POSTTHREADS * POSTCALLS)));
+    TEST_MESSAGE(message);
+}
+
+int main(void)
+{
+    testTelnet.begin(TESTPORT);
+    UNITY_BEGIN();
+    RUN_TEST(test_postlog_threads);
+    return UNITY_END();
+}